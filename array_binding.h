@@ -0,0 +1,61 @@
+#pragma once
+#include <cstddef>
+#include <type_traits>
+#include "ndarray.h"
+
+namespace mexbind0x {
+// Customization point that lets from_mx/to_mx bind an array type without copying.
+// Specialize mx_array_binding<T> with
+//
+//   using element_type = ...;            arithmetic element, selects the MATLAB class
+//   static constexpr size_t rank = ...;  number of dimensions
+//
+// and any of the following groups:
+//
+//   static T wrap(element_type *data, const size_t *shape, const ptrdiff_t *strides);
+//       from_mx: a view over MATLAB memory. The class must match element_type exactly,
+//       strides are in elements and describe MATLAB's column-major layout.
+//
+//   static const element_type *data(const T&);
+//   static size_t shape(const T&, size_t dim);
+//   static ptrdiff_t stride(const T&, size_t dim);
+//       to_mx: memory that is copied into a new mxArray, in a single memcpy
+//       when the strides are column-major contiguous.
+//
+//   static element_type *release(T&&);
+//       to_mx of an rvalue: hands over a contiguous column-major buffer allocated
+//       with mxMalloc, the mxArray adopts it instead of copying.
+template<typename T, typename = void>
+struct mx_array_binding;
+
+template<typename T, typename = void>
+struct mx_binding_wraps : std::false_type {};
+template<typename T>
+struct mx_binding_wraps<T, decltype((void)&mx_array_binding<T>::wrap)> : std::true_type {};
+
+template<typename T, typename = void>
+struct mx_binding_reads : std::false_type {};
+template<typename T>
+struct mx_binding_reads<T, decltype((void)&mx_array_binding<T>::data,
+                                    (void)&mx_array_binding<T>::shape,
+                                    (void)&mx_array_binding<T>::stride)> : std::true_type {};
+
+template<typename T, typename = void>
+struct mx_binding_releases : std::false_type {};
+template<typename T>
+struct mx_binding_releases<T, decltype((void)&mx_array_binding<T>::release)>
+    : mx_binding_reads<T> {};
+
+template<typename T>
+struct has_mx_array_binding
+    : std::integral_constant<bool, mx_binding_wraps<T>::value || mx_binding_reads<T>::value> {};
+
+template<typename T, int N>
+struct mx_array_binding<NDArrayView<T,N>> {
+    using element_type = T;
+    static constexpr size_t rank = N;
+    static const T *data(const NDArrayView<T,N> &v) { return v.m_data; }
+    static size_t shape(const NDArrayView<T,N> &v, size_t dim) { return v.dimensions[dim].maxIdx; }
+    static ptrdiff_t stride(const NDArrayView<T,N> &v, size_t dim) { return v.dimensions[dim].strife; }
+};
+} // namespace mexbind0x
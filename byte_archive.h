@@ -0,0 +1,166 @@
+#pragma once
+#include <array>
+#include <complex>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace mexbind0x {
+// Binary archives for types with save_load, the counterpart of CellSaver/CellLoader
+// when the object is stored outside of MATLAB (shared memory, files).
+class ByteSaver {
+    std::vector<char> buf;
+
+    void append(const void *p, size_t n) {
+        const char *c = static_cast<const char*>(p);
+        buf.insert(buf.end(), c, c + n);
+    }
+public:
+    template<typename T>
+    std::enable_if_t<std::is_arithmetic<T>::value> save(const T &t) {
+        append(&t, sizeof(t));
+    }
+
+    template<typename T>
+    void save(const std::complex<T> &t) {
+        append(&t, sizeof(t));
+    }
+
+    void save(const std::string &s) {
+        save<uint64_t>(s.size());
+        append(s.data(), s.size());
+    }
+
+    template<typename T, typename A>
+    void save(const std::vector<T,A> &v) {
+        save<uint64_t>(v.size());
+        save_range(v, std::is_arithmetic<T>());
+    }
+
+    template<typename T, size_t N>
+    void save(const std::array<T,N> &a) {
+        for (const auto &e : a) save(e);
+    }
+
+    template<typename T>
+    auto save(const T &t) -> decltype(save_load(std::declval<ByteSaver&>(), std::declval<T&>())) {
+        save_load(*this, const_cast<T&>(t));
+    }
+
+    template<typename T>
+    ByteSaver& operator<<(const T &t) {
+        save(t);
+        return *this;
+    }
+
+    template<typename T>
+    ByteSaver& operator&(const T &t) {
+        return *this << t;
+    }
+
+    const std::vector<char>& bytes() const {
+        return buf;
+    }
+
+private:
+    template<typename V>
+    void save_range(const V &v, std::true_type) {
+        append(v.data(), v.size() * sizeof(typename V::value_type));
+    }
+
+    template<typename V>
+    void save_range(const V &v, std::false_type) {
+        for (const auto &e : v) save(static_cast<const typename V::value_type&>(e));
+    }
+
+    void save_range(const std::vector<bool> &v, std::true_type) {
+        for (bool e : v) save<uint8_t>(e);
+    }
+};
+
+class ByteLoader {
+    const char *pos;
+    const char *end;
+
+    void read(void *p, size_t n) {
+        if (n > static_cast<size_t>(end - pos))
+            throw std::out_of_range("ByteLoader read past the end of data");
+        memcpy(p, pos, n);
+        pos += n;
+    }
+
+    size_t read_size() {
+        uint64_t n;
+        load(n);
+        return static_cast<size_t>(n);
+    }
+public:
+    ByteLoader(const void *data, size_t bytes)
+        : pos(static_cast<const char*>(data)), end(pos + bytes) {}
+
+    template<typename T>
+    std::enable_if_t<std::is_arithmetic<T>::value> load(T &t) {
+        read(&t, sizeof(t));
+    }
+
+    template<typename T>
+    void load(std::complex<T> &t) {
+        read(&t, sizeof(t));
+    }
+
+    void load(std::string &s) {
+        s.resize(read_size());
+        read(&s[0], s.size());
+    }
+
+    template<typename T, typename A>
+    void load(std::vector<T,A> &v) {
+        v.resize(read_size());
+        load_range(v, std::is_arithmetic<T>());
+    }
+
+    template<typename T, size_t N>
+    void load(std::array<T,N> &a) {
+        for (auto &e : a) load(e);
+    }
+
+    template<typename T>
+    auto load(T &t) -> decltype(save_load(std::declval<ByteLoader&>(), t)) {
+        save_load(*this, t);
+    }
+
+    template<typename T>
+    ByteLoader& operator>>(T &t) {
+        load(t);
+        return *this;
+    }
+
+    template<typename T>
+    ByteLoader& operator&(T &t) {
+        return *this >> t;
+    }
+
+private:
+    template<typename V>
+    void load_range(V &v, std::true_type) {
+        read(v.data(), v.size() * sizeof(typename V::value_type));
+    }
+
+    template<typename V>
+    void load_range(V &v, std::false_type) {
+        for (auto &e : v) load(e);
+    }
+
+    void load_range(std::vector<bool> &v, std::true_type) {
+        for (size_t i=0; i<v.size(); i++) {
+            uint8_t e;
+            load(e);
+            v[i] = e != 0;
+        }
+    }
+};
+} // namespace mexbind0x
@@ -0,0 +1,14 @@
+% Per-call cost of a scalar command, run after building funcs with test_all.
+% The budget (seconds per call) can be set before running the script.
+if ~exist('budget', 'var')
+    budget = 2e-6;
+end
+n = 1e6;
+funcs('add', 1, 2);
+tic;
+for i = 1:n
+    funcs('add', 1, 2);
+end
+per_call = toc / n;
+fprintf('funcs(''add'',1,2): %.0f ns per call (budget %.0f ns)\n', per_call*1e9, budget*1e9);
+assert(per_call < budget);
@@ -1,12 +1,75 @@
 #include "../mex_commands.h"
+#include "../mex_callback.h"
+#include "../half_float.h"
+#include "../ndarray_expr.h"
+#include "../ndarray_parallel.h"
+#ifndef _WIN32
+#include "../mmap_array.h"
+#endif
+#include <algorithm>
+#include <thread>
 #include <vector>
 
 using namespace mexbind0x;
 
 int add(int a, int b) { return a + b; }
 
+static std::vector<double> squares; // filled once by on_init
+static int init_count = 0;
+
 void mex(MXCommands &m) {
+  m.on_init([] {
+    squares.resize(1000);
+    for (size_t i = 0; i < squares.size(); i++)
+      squares[i] = double(i) * i;
+    init_count++;
+  });
+  m.on_exit([] { squares.clear(); });
+  m.on("init count", [] { return init_count; });
+  m.on("square", [](size_t i) { return squares.at(i); });
+  m.on("clamped axpy", [](double k, NDArrayView<const double, 2> x, NDArrayView<const double, 2> y) {
+    mxArray *res = mxCreateDoubleMatrix(x.max(0), x.max(1), mxREAL);
+    nd_assign(NDArrayView<double, 2>(res), nd_clamp(k * x + y, 0.0, 1.0));
+    return mx_array_t(res);
+  });
+  m.on("column means", [](NDArrayView<const double, 2> x) {
+    mxArray *res = mxCreateDoubleMatrix(1, x.max(1), mxREAL);
+    nd_mean_axis(x, 0, NDArrayView<double, 2>(res));
+    return mx_array_t(res);
+  });
+  m.on("pascal single", [](int n) {
+    std::vector<std::vector<int>> p(n, std::vector<int>(n, 1));
+    for (int i = 1; i < n; i++)
+      for (int j = 1; j < n; j++)
+        p[i][j] = p[i-1][j] + p[i][j-1];
+    return mx_auto::as<float>(p);
+  });
+  m.on("half scale", [](widened<float16> x, float k) {
+    for (auto &v : x.values)
+      v *= k;
+    return narrowed<float16>(std::move(x));
+  });
   m.on("add", add);
+  m.on_buffer<double>("buffer");
+  m.on_ring<double>("ring");
+  m.on("ring produce", [](mx_ring<double> *r, size_t n) {
+    std::thread producer([r, n] {
+      for (size_t i = 0; i < n; i++)
+        r->push(static_cast<double>(i));
+    });
+    producer.join();
+  });
+  runtime_commands(m);
+#ifndef _WIN32
+  mmap_commands(m);
+  m.on("mmap total", [](mmap_array<double, 2> x) {
+    double r = 0;
+    for (size_t j = 0; j < x.max(1); j++)
+      for (size_t i = 0; i < x.max(0); i++)
+        r += x(i, j);
+    return r;
+  });
+#endif
   m.on("sub", [](int a, int b) { return a - b; });
   m.on("sum", [](std::vector<std::vector<int>> v) {
     int r = 0;
@@ -22,6 +85,32 @@ void mex(MXCommands &m) {
         r += b;
     return r;
   });
+  m.on_memoized("cumsum", [](std::vector<double> v) {
+    for (size_t i = 1; i < v.size(); i++)
+      v[i] += v[i - 1];
+    return v;
+  });
+  m.on("median", [](scratch s, NDArrayView<const double, 1> x) {
+    scratch_vector<double> tmp(x.m_data, x.m_data + x.max(0), s.allocator<double>());
+    auto mid = tmp.begin() + tmp.size() / 2;
+    std::nth_element(tmp.begin(), mid, tmp.end());
+    return *mid;
+  });
+  m.on("map parallel", [](matlab_callback<double(double)> f, std::vector<double> x) {
+    f.set_batch(16);
+    auto done = std::async(std::launch::async, [&] {
+      std::vector<std::thread> workers;
+      for (size_t t = 0; t < 4; t++)
+        workers.emplace_back([&, t] {
+          for (size_t i = t; i < x.size(); i += 4)
+            x[i] = f(x[i]);
+        });
+      for (auto &w : workers)
+        w.join();
+    });
+    f.serve(done);
+    return x;
+  });
   m.on_varargout("divmod",
                  [](int nargout, int a, int b) -> std::vector<mx_auto> {
                    if (nargout == 2)
@@ -17,8 +17,17 @@ public:
 
     template<typename SaveLoader>
     friend void save_load(SaveLoader& m, my_class &t);
+
+    friend size_t memory_size(const my_class &t) {
+        return sizeof(t) + t.v.capacity() * sizeof(int);
+    }
 };
 
+// Counted by "_memory", spilled to a file when over "_memory_budget"
+namespace mexbind0x {
+ACCOUNTED(my_class, serialize);
+}
+
 template<typename SaveLoader>
 void save_load(SaveLoader& m, my_class &t)
 {
@@ -34,6 +43,7 @@ void mexFunction(int nlhs, mxArray* plhs[], int nrhs, const mxArray * prhs[])
             return new my_class(v);
         });
         m.on("get value", &my_class::get_value);
+        m.on_memory_commands();
         if (!m.has_matched())
             throw std::invalid_argument("Command not found");
     } catch (...) {
@@ -13,9 +13,61 @@ assert(funcs('sum bool', 2*eye(10)) == 10);
 assert(d == 2);
 assert(m == 1);
 assert(d == funcs('divmod', 15, 7));
+assert(isequal(funcs('cumsum', 1:4), [1;3;6;10]));
+assert(isequal(funcs('cumsum', 1:4), [1;3;6;10]));
+stats = funcs('_cache_stats');
+assert(stats.hits == 1);
+funcs('_cache_clear');
+[r, err] = funcs('_batch', {{'add',1,2}, {'sub',1,2}, {'missing'}});
+assert(r{1} == 3 && r{2} == -1 && isempty(r{3}));
+assert(isempty(err{1}) && ~isempty(err{3}));
+[r, err] = funcs('_batch', {{'divmod',15,7}, {'add',1,2}, {'_cache_stats'}}, [2 1 1]);
+assert(isequal(r{1}, {2, 1}) && r{2} == 3 && isstruct(r{3}) && all(cellfun(@isempty, err)));
+b = funcs('_new', 'buffer');
+funcs('_append', 'buffer', b, 1);
+funcs('_append', 'buffer', b, int32([2 3]));
+assert(funcs('_size', 'buffer', b) == 3);
+assert(isequal(funcs('_take', 'buffer', b), [1;2;3]));
+assert(funcs('_size', 'buffer', b) == 0);
+funcs('_free', 'buffer', b);
+r = funcs('_new', 'ring', 8);
+funcs('ring produce', r, 10);
+assert(isequal(funcs('_drain', 'ring', r, 3), [0;1;2]));
+assert(isequal(funcs('_drain', 'ring', r, Inf, 0.1), (3:7)'));
+st = funcs('_stats', 'ring', r);
+assert(st.overruns == 2 && st.dropped == 2 && st.size == 0);
+funcs('_free', 'ring', r);
+if isunix
+    f = [tempname '.bin'];
+    x = reshape(1:12, 3, 4);
+    funcs('_mmap_write', f, x);
+    h = funcs('_mmap_open', f);
+    assert(isequal(funcs('_mmap_size', h), [3; 4]));
+    assert(isequal(funcs('_mmap_read', h, 1, 2), x(:, 2:3)));
+    funcs('_free', 'mmap_handle', h);
+    assert(funcs('mmap total', f) == 78);
+    assert(funcs('mmap total', struct('path', f, 'shape', [3 2], 'offset', 64 + 24)) == 39);
+    delete(f);
+end
+funcs('_warmup');
+assert(funcs('init count') == 1 && funcs('square', 12) == 144);
+assert(isequal(funcs('half scale', uint16([15360 0]), 2), uint16([16384 0])));
+assert(isequal(funcs('clamped axpy', 2, [0.1 0.2; 0.3 0.4], [0 0.5; 0 0.5]), [0.2 0.9; 0.6 1]));
+assert(isequal(funcs('pascal single', 4), single(pascal(4))));
+x = reshape(1:12, 3, 4);
+assert(isequal(funcs('column means', x), mean(x, 1)));
+rt = funcs('_runtime_stats');
+assert(rt.holders >= 1 && rt.pool_threads >= 1 && rt.pool_tasks >= 1 && rt.memo_hits >= 1);
+assert(funcs('median', [5 1 4 2 3]) == 3);
+assert(isequal(funcs('map parallel', @(x) x.^2, 1:10), (1:10)'.^2));
 
 a = my_class_wrap(1:10);
 assert(isequal(a.get', 1:10));
+my_class('_memory_budget', 0);
+mem = my_class('_memory');
+assert(mem.classes(1).objects == 1 && mem.classes(1).spilled == 1);
+assert(isequal(a.get', 1:10));
+my_class('_memory_budget', Inf);
 
 assert(one_func(3) == 9);
 test_types
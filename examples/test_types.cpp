@@ -1,4 +1,15 @@
 #include "../mex_commands.h"
+#include "../half_float.h"
+#include "../ndarray_expr.h"
+#include "../mex_array.h"
+#include "../mex_stream.h"
+#include "../ndarray_parallel.h"
+#include "../mex_memory.h"
+#include "../string_table.h"
+#ifndef _WIN32
+#include "../shm_store.h"
+#include "../mmap_array.h"
+#endif
 #include <mex.h>
 
 using namespace std;
@@ -14,10 +25,619 @@ void t(T val)
     }
 }
 
+void check(bool ok, const char *what)
+{
+    if (!ok)
+        mexErrMsgTxt(stringer("Check failed: ", what, ".").c_str());
+}
+
+// Views larger than 2^31 elements, only offsets are computed
+void test_large_index() {
+    char buf[1];
+    size_t rows = size_t(1) << 20, cols = size_t(1) << 13;
+    auto v = makeNDArrayViewFromCArray(buf, rows, cols, 3);
+    check(v.count_offset(0, rows-1, cols-1, 2) == rows*cols*3 - 1, "large view offset");
+    check(v.dimensions[0].strife == cols*3, "large view stride");
+    std::array<size_t,3> dim{{65536, 65536, 2}}, idx{{65535, 65535, 1}};
+    check(matlab_index(dim, idx) == size_t(65536)*65536*2 - 1, "large matlab_index");
+    bool thrown = false;
+    try {
+        makeNDArrayViewFromCArray(buf, SIZE_MAX/2, 4);
+    } catch (const std::overflow_error &) {
+        thrown = true;
+    }
+    check(thrown, "shape overflow detection");
+}
+
+// Every float16 value survives widen and narrow, uint16 arrays are read as the encoding
+void test_half() {
+    std::vector<float16> h(65536), back(65536);
+    std::vector<float> f(65536);
+    for (size_t i=0; i<h.size(); i++) h[i].bits = static_cast<uint16_t>(i);
+    widen(h.data(), h.size(), f.data());
+    narrow(f.data(), f.size(), back.data());
+    for (size_t i=0; i<h.size(); i++)
+        if ((i & 0x7c00) != 0x7c00 || !(i & 0x3ff))
+            check(back[i].bits == i, "float16 round trip");
+    check(float16(65520.f).bits == 0x7c00, "float16 overflow");
+    check(bfloat16(1.00390625f).bits == 0x3f80, "bfloat16 rounding");
+    check(float(from_mx<float16>(to_mx(uint16_t(0x3c00)))) == 1.0f, "float16 from uint16");
+    check(from_mx<bfloat16>(mxCreateDoubleScalar(2.0)).bits == 0x4000, "bfloat16 from double");
+}
+
+struct record {
+    int id;
+    double score;
+    std::string name;
+    template<typename SaveLoader>
+    friend void save_load(SaveLoader &s, record &r) {
+        s & r.id & r.score & r.name;
+    }
+};
+
+// Vectors of records are converted to a struct of columns and back
+void test_records() {
+    std::vector<record> v{{1, 0.5, "a"}, {2, 1.5, "bc"}};
+    mxArray *m = to_mx(v);
+    check(mxIsStruct(m) && mxGetNumberOfFields(m) == 3, "record columns");
+    check(mxGetClassID(mxGetField(m, 0, "f1")) == mxINT32_CLASS, "numeric record column");
+    check(mxIsCell(mxGetField(m, 0, "f3")), "cell record column");
+    auto back = from_mx<std::vector<record>>(m);
+    check(back.size() == 2 && back[1].id == 2 && back[1].score == 1.5 && back[1].name == "bc",
+          "record round trip");
+}
+
+// Fused expression over a contiguous and a transposed view
+void test_expr() {
+    double a[6] = {1, 2, 3, 4, 5, 6}, b[6] = {6, 5, 4, 3, 2, 1}, out[6];
+    auto A = makeNDArrayViewFromCArray(a, 2, 3);
+    auto O = makeNDArrayViewFromCArray(out, 2, 3);
+    NDArrayView<double,2> Bt = makeNDArrayViewFromCArray(b, 3, 2);
+    std::swap(Bt.dimensions[0], Bt.dimensions[1]);
+    nd_assign(O, nd_where(A > 2.0, nd_clamp(A*2.0 - Bt, 0.0, 5.0), -A));
+    check(out[0] == -1 && out[1] == -2 && out[2] == 4 && out[3] == 3 && out[5] == 5, "fused expression");
+}
+
+// Element class and shape chosen at output, nested, fixed and strided sources
+void test_output_policy() {
+    mxArray *m = to_mx_as<double>(vector<vector<int>>{{1, 2, 3}, {4, 5, 6}});
+    check(mxIsDouble(m) && mxGetM(m) == 2 && mxGetN(m) == 3 && mxGetPr(m)[1] == 4 && mxGetPr(m)[2] == 2,
+          "nested vector as double");
+    m = to_mx_as<float>(vector<vector<int>>{{1, 2, 3}, {4, 5, 6}}, mx_shape::row);
+    check(mxIsSingle(m) && mxGetM(m) == 1 && mxGetN(m) == 6 && static_cast<float*>(mxGetData(m))[1] == 4,
+          "nested vector as single row");
+    m = to_mx_as<complex<double>>(array<array<int,2>,2>{{{{1, 2}}, {{3, 4}}}});
+    check(mxIsComplex(m) && mxGetM(m) == 2 && mxGetPr(m)[1] == 3 && static_cast<double*>(mxGetImagData(m))[1] == 0, "array as complex");
+    int a[6] = {1, 2, 3, 4, 5, 6};
+    NDArrayView<int,2> v = makeNDArrayViewFromCArray(a, 2, 3);
+    m = to_mx_as<double>(v, mx_shape::column);
+    check(mxGetM(m) == 6 && mxGetN(m) == 1 && mxGetPr(m)[1] == 4 && mxGetPr(m)[2] == 2, "view as double column");
+}
+
+// Element access converting from other classes, strided and out-of-range gathers
+void test_mx_array() {
+    mxArray *m = mxCreateNumericMatrix(2, 3, mxINT32_CLASS, mxREAL);
+    int32_t *p = static_cast<int32_t*>(mxGetData(m));
+    for (int i=0; i<6; i++) p[i] = i + 1;
+    MXArray a(m);
+    check(a.get<double>(1, 2) == 6 && a.get1<float>(3) == 4, "int32 read as double and single");
+    vector<double> all(6);
+    a.copy_to(all);
+    check(all[0] == 1 && all[5] == 6, "copy_to from int32");
+    vector<double> r = a.row<double>(1), c = a.col<double>(2);
+    check(r.size() == 3 && r[0] == 2 && r[2] == 6, "row extraction");
+    check(c.size() == 2 && c[0] == 5 && c[1] == 6, "column extraction");
+    double g[3];
+    a.gather(0, 2, 3, g);
+    check(g[0] == 1 && g[1] == 3 && g[2] == 5, "strided gather");
+    a.gather(4, 0, 3, g);
+    check(g[0] == 5 && g[2] == 5, "stride 0 gather");
+    bool thrown = false;
+    try { a.gather(1, 2, 4, g); } catch (const std::out_of_range &) { thrown = true; }
+    check(thrown, "gather past the end");
+    thrown = false;
+    try { a.gather(6, 0, 1, g); } catch (const std::out_of_range &) { thrown = true; }
+    check(thrown, "gather from past the end");
+    mxArray *s = mxCreateNumericMatrix(1, 2, mxSINGLE_CLASS, mxREAL);
+    static_cast<float*>(mxGetData(s))[1] = 2.5f;
+    check(MXArray(s).get<double>(0, 1) == 2.5 && MXArray(s).get<int>(0, 0) == 0, "single read as double and int");
+}
+
+// A user-defined column-major grid bound without copies
+struct grid {
+    double *p = nullptr;
+    size_t rows = 0, cols = 0;
+};
+namespace mexbind0x {
+template<>
+struct mx_array_binding<grid> {
+    using element_type = double;
+    static constexpr size_t rank = 2;
+    static grid wrap(double *data, const size_t *shape, const ptrdiff_t *) {
+        return grid{data, shape[0], shape[1]};
+    }
+    static const double *data(const grid &g) { return g.p; }
+    static size_t shape(const grid &g, size_t dim) { return dim ? g.cols : g.rows; }
+    static ptrdiff_t stride(const grid &g, size_t dim) { return dim ? g.rows : 1; }
+    static double *release(grid &&g) {
+        double *res = g.p;
+        g.p = nullptr;
+        return res;
+    }
+};
+}
+
+void test_array_binding() {
+    mxArray *m = mxCreateDoubleMatrix(2, 3, mxREAL);
+    for (int i=0; i<6; i++) mxGetPr(m)[i] = i;
+    grid g = from_mx<grid>(m);
+    check(g.p == mxGetPr(m) && g.rows == 2 && g.cols == 3, "binding wraps without copying");
+    mxArray *c = to_mx(g);
+    check(mxGetPr(c) != g.p && mxGetN(c) == 3 && mxGetPr(c)[5] == 5, "binding read copies");
+    grid owned{static_cast<double*>(mxMalloc(4 * sizeof(double))), 1, 4};
+    for (int i=0; i<4; i++) owned.p[i] = 10 + i;
+    double *buf = owned.p;
+    mxArray *r = to_mx(std::move(owned));
+    check(mxGetPr(r) == buf && owned.p == nullptr, "binding release adopts the buffer");
+    check(mxGetM(r) == 1 && mxGetN(r) == 4 && mxGetPr(r)[3] == 13, "released array shape");
+    mxDestroyArray(r);
+    mxDestroyArray(c);
+    mxDestroyArray(m);
+}
+
+// Chunks in order, the last one short, read in place or converted on the helper thread
+void test_stream() {
+    mxArray *d = mxCreateDoubleMatrix(10, 1, mxREAL);
+    mxArray *m = mxCreateNumericMatrix(1, 10, mxINT32_CLASS, mxREAL);
+    for (int i=0; i<10; i++) {
+        mxGetPr(d)[i] = i;
+        static_cast<int32_t*>(mxGetData(m))[i] = i;
+    }
+    for (mxArray *a : {d, m}) {
+        mx_stream<double> s(a);
+        s.set_budget(3 * 2 * sizeof(double));
+        vector<double> seen;
+        vector<size_t> counts;
+        const double *first = nullptr;
+        s.for_each_chunk([&](const double *chunk, size_t count, size_t offset) {
+            check(offset == seen.size(), "chunk offsets in order");
+            if (!first) first = chunk;
+            seen.insert(seen.end(), chunk, chunk + count);
+            counts.push_back(count);
+        });
+        check(counts.size() == 4 && counts[3] == 1, "chunk count with a short last chunk");
+        check(seen.size() == 10 && seen[9] == 9, "streamed elements");
+        check((first == mxGetPr(d)) == (a == d), "same class chunks point into the input");
+    }
+    bool thrown = false;
+    try {
+        mx_stream<double>(m).for_each_chunk([](const double*, size_t, size_t) { throw std::runtime_error("stop"); });
+    } catch (const std::runtime_error &) {
+        thrown = true;
+    }
+    check(thrown, "exception from the chunk function");
+}
+
+// Hits only for inputs equal to the stored ones, statistics reset by clear
+void test_memoized() {
+    auto &cache = memo_cache();
+    cache.clear();
+    auto recorded = [](const char *name) {
+        const mxArray *f = mxGetField(runtime_stats_struct(), 0, name);
+        return f ? mxGetScalar(f) : 0;
+    };
+    double hits0 = recorded("memo_hits"), misses0 = recorded("memo_misses");
+    int calls = 0;
+    auto run = [&](double x) {
+        const mxArray *in[] = {mxCreateString("sq"), mxCreateDoubleScalar(x)};
+        mxArray *out[1] = {nullptr};
+        MXCommands m(1, out, 2, in);
+        m.on_memoized("sq", [&](double v) { calls++; return v*v; });
+        return mxGetScalar(out[0]);
+    };
+    check(run(3) == 9 && run(3) == 9 && calls == 1, "memoized hit");
+    check(run(4) == 16 && calls == 2 && cache.hits == 1 && cache.misses == 2, "memoized miss");
+    // An entry under the key of 5 computed from 6 is a colliding hash, not a hit
+    const mxArray *five = mxCreateDoubleScalar(5), *six = mxCreateDoubleScalar(6);
+    mxArray *wrong = mxCreateDoubleScalar(36);
+    uint64_t hash = hash_mix(0, 1);
+    hash_mx(five, hash);
+    cache.insert(memo_key{"sq", hash, 1}, memo_entry{persistent_arrays(&six, 1), persistent_arrays(&wrong, 1)}, 0);
+    check(run(5) == 25 && calls == 3, "memoized collision recomputed");
+    check(run(5) == 25 && calls == 3, "memoized entry replaced");
+    check(recorded("memo_hits") - hits0 == cache.hits && recorded("memo_misses") - misses0 == cache.misses,
+          "memoized collision counted once");
+    cache.clear();
+    check(cache.size() == 0 && cache.hits == 0 && cache.misses == 0 && cache.evictions == 0, "memo cache clear");
+}
+
+// struct('data', array, 'version', v) keys cached<T> on the version, not the contents
+void test_cached_version() {
+    cached_store().clear();
+    mxArray *a = mxCreateDoubleMatrix(3, 1, mxREAL);
+    mxGetPr(a)[0] = 1;
+    const char *fields[] = {"data", "version"};
+    mxArray *s = mxCreateStructMatrix(1, 1, 2, fields);
+    mxSetField(s, 0, "data", a);
+    mxSetField(s, 0, "version", mxCreateDoubleScalar(1));
+    cached<vector<double>> first(s);
+    mxGetPr(a)[0] = 2;
+    cached<vector<double>> same(s);
+    check(&same.get() == &first.get() && same.get()[0] == 1, "cached hit on the same version");
+    mxGetPr(mxGetField(s, 0, "version"))[0] = 2;
+    cached<vector<double>> next(s);
+    check(next.get()[0] == 2 && cached_store().size() == 2, "cached miss on a new version");
+    cached<vector<float>> other(s);
+    check(other.get()[0] == 2 && cached_store().size() == 3, "cached entries separated by element type");
+    mxSetField(s, 0, "version", mxCreateString("v1"));
+    bool thrown = false;
+    try { cached<vector<double>> bad(s); } catch (const std::invalid_argument &) { thrown = true; }
+    check(thrown, "cached version should be numeric");
+    cached_store().clear();
+}
+
+// Cellstr with non-ASCII and missing elements, char matrix rows, empty cell
+void test_string_table() {
+    mxArray *c = mxCreateCellMatrix(1, 3);
+    mxSetCell(c, 0, mxCreateString("ab"));
+    mwSize d[2] = {1, 3};
+    mxArray *u = mxCreateCharArray(2, d);
+    const mxChar units[] = {0xE9, 0xD83D, 0xDE00}; // e acute, U+1F600
+    memcpy(mxGetData(u), units, sizeof(units));
+    mxSetCell(c, 2, u);
+    string_table t(c);
+    check(t.size() == 3 && t.str(0) == "ab" && t.length(1) == 0, "cellstr elements");
+    check(t.str(2) == "\xC3\xA9\xF0\x9F\x98\x80", "cellstr UTF-8 encoding");
+    mxArray *back = to_mx(t);
+    check(mxGetN(back) == 3 && mxGetNumberOfElements(mxGetCell(back, 2)) == 3
+          && static_cast<mxChar*>(mxGetData(mxGetCell(back, 2)))[2] == 0xDE00, "cellstr round trip");
+    const char *rows[] = {"one", "three"};
+    string_table m(mxCreateCharMatrixFromStrings(2, rows));
+    check(m.size() == 2 && m.str(0) == "one  " && m.str(1) == "three", "char matrix rows");
+    check(m.dimensions()[0] == 2 && m.dimensions()[1] == 1, "char matrix shape");
+    string_table e(mxCreateCellMatrix(0, 0));
+    check(e.size() == 0 && e.dimensions()[0] == 0 && mxGetNumberOfElements(to_mx(e)) == 0, "empty cell");
+    check(from_mx<std::string>(mxCreateString("text")) == "text", "from_mx string");
+}
+
+#ifndef _WIN32
+// put, attach as a view, read back, release; a stale segment is replaced after unlinking
+void test_shm() {
+    std::string name = stringer("test_types.", getpid());
+    mxArray *m = mxCreateNumericMatrix(2, 3, mxINT32_CLASS, mxREAL);
+    for (int i=0; i<6; i++) static_cast<int32_t*>(mxGetData(m))[i] = i;
+    shm_put_array(name, m);
+    {
+        shm_view<int32_t,2> v(name);
+        check(v.dimensions[1].maxIdx == 3 && v(1, 2) == 5, "shm view");
+        mxArray *copy = shm_get_array(name);
+        check(mxGetN(copy) == 3 && static_cast<int32_t*>(mxGetData(copy))[4] == 4, "shm get");
+        mxDestroyArray(copy);
+    }
+    shm_release(name);
+    bool thrown = false;
+    try { shm_view<int32_t,2> gone(name); } catch (const std::runtime_error &) { thrown = true; }
+    check(thrown, "shm segment removed by the last release");
+    int fd = shm_open(("/mexbind0x." + name).c_str(), O_CREAT | O_RDWR, 0600); // left by a crashed process
+    close(fd);
+    thrown = false;
+    try { shm_put_array(name, m); } catch (const std::runtime_error &) { thrown = true; }
+    check(thrown && shm_unlink_segment(name), "stale shm segment");
+    shm_put_array(name, m);
+    check(shm_view<int32_t,2>(name)(0, 1) == 2, "shm segment replaced");
+    shm_release(name);
+    check(!shm_unlink_segment(name), "shm segment released");
+}
+
+// mmap_write, then a view of the whole file, a struct layout and slices of a handle
+void test_mmap() {
+    std::string path = stringer("/tmp/test_types.", getpid(), ".bin");
+    mxArray *m = mxCreateNumericMatrix(3, 4, mxINT16_CLASS, mxREAL);
+    for (int i=0; i<12; i++) static_cast<int16_t*>(mxGetData(m))[i] = i + 1;
+    mmap_write(path, m);
+    mmap_array<int16_t,2> v(path);
+    check(v.max(0) == 3 && v.max(1) == 4 && v(2, 3) == 12, "mmap view");
+    const char *fields[] = {"path", "shape", "class", "offset"};
+    mxArray *spec = mxCreateStructMatrix(1, 1, 4, fields);
+    mxSetField(spec, 0, "path", mxCreateString(path.c_str()));
+    mxSetField(spec, 0, "shape", to_mx(vector<double>{3, 2}));
+    mxSetField(spec, 0, "class", mxCreateString("int16"));
+    mxSetField(spec, 0, "offset", mxCreateDoubleScalar(mmap_header_size(2) + 3*sizeof(int16_t)));
+    mmap_array<int16_t,2> s(spec);
+    check(s.max(1) == 2 && s(0, 0) == 4 && s(2, 1) == 9, "mmap struct layout");
+    mmap_handle h(mmap_read_header(path));
+    mxArray *slice = h.read(1, 2).m;
+    check(mxGetM(slice) == 3 && mxGetN(slice) == 2 && static_cast<int16_t*>(mxGetData(slice))[5] == 9, "mmap slice");
+    bool thrown = false;
+    try { h.read(3, 2); } catch (const std::out_of_range &) { thrown = true; }
+    check(thrown, "mmap slice out of range");
+    unlink(path.c_str());
+}
+#endif
+
+// Several outputs per entry, library commands inside a batch, failing entries
+void test_batch() {
+    auto f = [](MXCommands &m) {
+        m.on_varargout("divmod", [](int nargout, int a, int b) -> std::vector<mx_auto> {
+            if (nargout == 2) return {a / b, a % b};
+            return {a / b};
+        });
+    };
+    mxArray *entries = mxCreateCellMatrix(1, 3);
+    mxArray *e0 = mxCreateCellMatrix(1, 3), *e1 = mxCreateCellMatrix(1, 1), *e2 = mxCreateCellMatrix(1, 1);
+    mxSetCell(e0, 0, mxCreateString("divmod"));
+    mxSetCell(e0, 1, mxCreateDoubleScalar(15));
+    mxSetCell(e0, 2, mxCreateDoubleScalar(7));
+    mxSetCell(e1, 0, mxCreateString("_cache_stats"));
+    mxSetCell(e2, 0, mxCreateString("missing"));
+    mxSetCell(entries, 0, e0);
+    mxSetCell(entries, 1, e1);
+    mxSetCell(entries, 2, e2);
+    const mxArray *in[] = {mxCreateString("_batch"), entries, to_mx(vector<double>{2, 1, 1})};
+    mxArray *out[2] = {nullptr, nullptr};
+    check(run_batch(f, 2, out, 3, in), "batch matched");
+    const mxArray *r0 = mxGetCell(out[0], 0);
+    check(mxIsCell(r0) && mxGetNumberOfElements(r0) == 2 && mxGetScalar(mxGetCell(r0, 1)) == 1,
+          "batch entry with two outputs");
+    check(mxIsStruct(mxGetCell(out[0], 1)), "batch entry of a library command");
+    check(mxIsEmpty(mxGetCell(out[0], 2)) && !mxIsEmpty(mxGetCell(out[1], 2)), "failing batch entry");
+    bool rejected = true;
+    for (double count : {-1.0, std::nan(""), 1.5, 1e12}) {
+        const mxArray *bad[] = {in[0], entries, mxCreateDoubleScalar(count)};
+        try {
+            run_batch(f, 2, out, 3, bad);
+            rejected = false;
+        } catch (const std::invalid_argument &) {}
+    }
+    check(rejected, "batch output counts validated");
+}
+
+#ifdef MEXBIND0X_TRACE
+// Pool tasks and the inline part of parallel_for are recorded as worker spans
+void test_worker_trace() {
+    trace_events().clear();
+    thread_pool pool(2);
+    pool.parallel_for(8, [](size_t) {});
+    pool.stop();
+    check(trace_events().size() >= 8, "worker spans");
+}
+#endif
+
+// Pool and cache counters in _runtime_stats, without starting the pool
+void test_runtime_stats() {
+    auto field = [](const mxArray *st, const char *name) {
+        const mxArray *f = mxGetField(st, 0, name);
+        return f ? mxGetScalar(f) : -1;
+    };
+    mxArray *st = runtime_stats_struct();
+    check(field(st, "pool_threads") == 0 && field(st, "memo_hits") >= 1 && field(st, "memo_misses") >= 2,
+          "runtime stats fields");
+    const mxArray *in[] = {mxCreateString("_runtime_cache_limit"), mxCreateDoubleScalar(-1)};
+    mxArray *out[1] = {nullptr};
+    bool thrown = false;
+    try {
+        MXCommands m(0, out, 2, in);
+        runtime_commands(m);
+    } catch (const std::exception &) {
+        thrown = true;
+    }
+    check(thrown && runtime_cache_budget().limit.load() == SIZE_MAX, "negative cache limit rejected");
+}
+
+// Nested loops, exceptions, and reductions and transforms over slices on small pools
+void test_parallel() {
+    thread_pool pool(3);
+    std::atomic<size_t> count{0};
+    pool.parallel_for(4, [&](size_t) {
+        pool.parallel_for(8, [&](size_t) { count++; });
+    });
+    check(count == 32, "nested parallel_for");
+    bool thrown = false;
+    try {
+        pool.parallel_for(16, [](size_t i) { if (i == 5) throw std::runtime_error("task"); });
+    } catch (const std::runtime_error &) {
+        thrown = true;
+    }
+    check(thrown, "parallel_for exception");
+    pool.parallel_for(4, [&](size_t) { count++; });
+    check(count == 36, "pool usable after an exception");
+
+    std::vector<float> a(30 * 20);
+    for (size_t i=0; i<a.size(); i++) a[i] = 1.0f / (1 + i % 97);
+    auto v = makeNDArrayViewFromCArray(a.data(), 30, 20);
+    auto slice = limit(v, std::make_pair<size_t,size_t>(3, 27), limits::all());
+    float serial = 0;
+    for (size_t i=3; i<27; i++)
+        for (size_t j=0; j<20; j++) serial += v(i, j);
+    nd_parallel_options opt;
+    opt.grain = 7;
+    opt.deterministic = true;
+    thread_pool one(1);
+    opt.pool = &one;
+    float r1 = nd_parallel_reduce(slice, 0.0f, [](float x, float y) { return x + y; }, opt);
+    opt.pool = &pool;
+    float r3 = nd_parallel_reduce(slice, 0.0f, [](float x, float y) { return x + y; }, opt);
+    check(r1 == r3 && std::abs(r1 - serial) < 1e-3f, "deterministic reduce over a slice");
+
+    std::vector<double> out(24 * 20);
+    auto o = makeNDArrayViewFromCArray(out.data(), 24, 20);
+    opt.deterministic = false;
+    nd_parallel_transform(slice, o, [](float x) { return 2.0 * x; }, opt);
+    check(o(0, 0) == 2.0 * v(3, 0) && o(23, 19) == 2.0 * v(26, 19), "transform of a slice");
+    auto column = limit(v, limits::all(), 4);
+    double csum = nd_parallel_reduce(column, 0.0, [](double x, double y) { return x + y; }, opt);
+    double cserial = 0;
+    for (size_t i=0; i<30; i++) cserial += v(i, 4);
+    check(std::abs(csum - cserial) < 1e-9, "reduce over a strided column");
+    pool.stop();
+    thrown = false;
+    try { pool.submit([] {}); } catch (const std::logic_error &) { thrown = true; }
+    check(thrown, "push after stop");
+    thrown = false;
+    count = 0;
+    try { pool.parallel_for(4, [&](size_t) { count++; }); } catch (const std::logic_error &) { thrown = true; }
+    check(thrown && count == 0, "parallel_for after stop");
+}
+
+// Objects accounted by a memory_registry: spilled to a file, or failing to spill
+struct spilled_block {
+    std::vector<double> v;
+    template<typename SaveLoader>
+    friend void save_load(SaveLoader &s, spilled_block &b) { s & b.v; }
+    friend size_t memory_size(const spilled_block &b) { return sizeof(b) + b.v.size() * sizeof(double); }
+};
+struct stuck_block {
+    std::vector<double> v = std::vector<double>(1000);
+    friend size_t memory_size(const stuck_block &b) { return sizeof(b) + b.v.size() * sizeof(double); }
+    friend void mx_evict(stuck_block &) { throw std::runtime_error("cannot evict"); }
+    friend void mx_restore(stuck_block &) {}
+};
+namespace mexbind0x {
+ACCOUNTED(spilled_block, serialize);
+ACCOUNTED(stuck_block, recompute);
+}
+
+// LRU order, objects of the current call kept, spill and restore, remove while spilled.
+// mex_call_number() is advanced by hand to start the next call.
+void test_memory_registry() {
+    memory_registry reg;
+    spilled_block a, b, c;
+    a.v.assign(1000, 1);
+    b.v.assign(1000, 2);
+    c.v.assign(1000, 3);
+    mex_call_number()++;
+    reg.add(&a);
+    reg.add(&b);
+    reg.add(&c);
+    mex_call_number()++;
+    reg.touch(&a);
+    mex_call_number()++;
+    reg.set_budget(reg.total() - 1);
+    check(b.v.empty() && a.v.size() == 1000 && c.v.size() == 1000, "least recently used spilled first");
+    reg.touch(&c);
+    reg.set_budget(0);
+    check(a.v.empty() && c.v.size() == 1000, "object used by the current call kept");
+    mex_call_number()++;
+    reg.set_budget(std::numeric_limits<size_t>::max());
+    reg.touch(&b);
+    check(b.v.size() == 1000 && b.v[999] == 2, "spill and restore");
+    reg.remove(&a);
+    mxArray *r = reg.report();
+    check(mxGetScalar(mxGetField(r, 0, "spilled")) == 0, "remove while spilled");
+    check(mxGetScalar(mxGetField(mxGetField(r, 0, "classes"), 0, "objects")) == 2, "objects after remove");
+    stuck_block s;
+    reg.add(&s);
+    mex_call_number()++;
+    reg.set_budget(0);
+    check(s.v.size() == 1000 && c.v.empty(), "object failing to spill stays resident");
+    reg.touch(&s);
+    reg.remove(&s);
+    reg.remove(&b);
+    reg.remove(&c);
+}
+
+// Buffer capacities that overflow the byte count are rejected before allocating
+void test_buffer_sizes() {
+    auto run = [](const char *command, double n) {
+        const mxArray *in[] = {mxCreateString(command), mxCreateString("buffer"), mxCreateDoubleScalar(n)};
+        mxArray *out[1] = {nullptr};
+        try {
+            MXCommands m(1, out, 3, in);
+            m.on_buffer<double>("buffer");
+        } catch (std::exception&) {
+            return false;
+        }
+        delete from_mx<mx_buffer<double>*>(out[0]);
+        return true;
+    };
+    check(run("_new", 16), "buffer of 16");
+    check(!run("_new", std::ldexp(1.0, 61)) && !run("_new", -1) && !run("_new", 1e30) && !run("_new", 2.5),
+          "buffer capacity validated");
+    mx_buffer<double> b;
+    bool too_large = false;
+    try { b.reserve(std::numeric_limits<size_t>::max() / 4); } catch (std::overflow_error&) { too_large = true; }
+    check(too_large && b.capacity() == 0, "buffer byte count overflow");
+    double x = 1;
+    b.append(&x, 1);
+    check(b.size() == 1 && b.data()[0] == 1, "buffer append");
+}
+
+// A producer thread wakes the consumer waiting in wait_for, the drain wraps around the end
+void test_ring() {
+    mx_ring<double> r(8);
+    for (int i=0; i<5; i++)
+        r.push(-1.0);
+    mxDestroyArray(r.drain());
+    std::thread producer([&r] {
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        for (int i=0; i<6; i++)
+            r.push(double(i));
+    });
+    bool woken = r.wait_for(6, std::chrono::seconds(5));
+    producer.join();
+    check(woken, "ring consumer woken by the producer");
+    mxArray *a = r.drain();
+    const double *p = mxGetPr(a);
+    bool ordered = mxGetNumberOfElements(a) == 6;
+    for (size_t i=0; ordered && i<6; i++)
+        ordered = p[i] == double(i);
+    check(ordered, "wrapped ring drain keeps the order");
+    check(r.drained() == 11 && r.size() == 0 && r.overruns() == 0, "ring counters");
+    mxDestroyArray(a);
+
+    bool too_long = false, too_wide = false;
+    try { mx_ring<double> big(std::numeric_limits<size_t>::max()); } catch (std::length_error&) { too_long = true; }
+    try { mx_ring<double> wide(4, std::numeric_limits<size_t>::max()); } catch (std::overflow_error&) { too_wide = true; }
+    check(too_long && too_wide, "ring size overflow rejected");
+    auto create = [](double capacity, double channels) {
+        const mxArray *in[] = {mxCreateString("_new"), mxCreateString("ring"),
+                               mxCreateDoubleScalar(capacity), mxCreateDoubleScalar(channels)};
+        mxArray *out[1] = {nullptr};
+        try {
+            MXCommands m(1, out, 4, in);
+            m.on_ring<double>("ring");
+        } catch (std::exception&) {
+            return false;
+        }
+        delete from_mx<mx_ring<double>*>(out[0]);
+        return true;
+    };
+    check(create(8, 2) && !create(1e30, 1) && !create(-1, 1) && !create(8, 0) && !create(8, std::nan("")),
+          "ring _new arguments validated");
+}
+
 void test_types() {
     t(vector<int>{1,2,3,4});
     t(vector<bool>{1,0,0,1});
     t(vector<vector<bool>>{{1,0},{0,1},{1,1},{0,0}});
+    t(array<double,3>{{1,2,3}});
+    t(array<array<int,3>,2>{{{{1,2,3}},{{4,5,6}}}});
+    t(fixed_matrix<float,2,2>{{1,2,3,4}});
+    t(vector<array<double,3>>{{{1,2,3}},{{4,5,6}}});
+    test_large_index();
+    test_half();
+    test_records();
+    test_expr();
+    test_output_policy();
+    test_mx_array();
+    test_array_binding();
+    test_stream();
+    test_memoized();
+    test_runtime_stats();
+    test_cached_version();
+    test_batch();
+    test_parallel();
+    test_memory_registry();
+    test_buffer_sizes();
+    test_ring();
+#ifdef MEXBIND0X_TRACE
+    test_worker_trace();
+#endif
+    test_string_table();
+#ifndef _WIN32
+    test_shm();
+    test_mmap();
+#endif
     mexPrintf("Tests completed successfully\n");
 }
 
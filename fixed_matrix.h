@@ -0,0 +1,94 @@
+#pragma once
+#include <array>
+#include <complex>
+#include <cstddef>
+#include <type_traits>
+
+namespace mexbind0x {
+// R x C matrix with inline column-major storage, maps to a MATLAB R x C array
+template<typename T, size_t R, size_t C>
+struct fixed_matrix {
+    using value_type = T;
+    static constexpr size_t rows = R;
+    static constexpr size_t cols = C;
+    T data[R*C];
+
+    T& operator()(size_t r, size_t c) { return data[r + c*R]; }
+    const T& operator()(size_t r, size_t c) const { return data[r + c*R]; }
+
+    friend bool operator==(const fixed_matrix &a, const fixed_matrix &b) {
+        for (size_t i=0; i<R*C; i++)
+            if (a.data[i] != b.data[i]) return false;
+        return true;
+    }
+    friend bool operator!=(const fixed_matrix &a, const fixed_matrix &b) {
+        return !(a == b);
+    }
+};
+
+template<typename T>
+struct is_std_array : std::false_type {};
+template<typename T, size_t N>
+struct is_std_array<std::array<T,N>> : std::true_type {};
+
+// Compile-time layout of fixed-shape types.
+// at<K> returns the element with column-major linear index K.
+template<typename T, typename = void>
+struct fixed_layout {
+    static constexpr bool value = false;
+    static constexpr size_t rank = 0;
+};
+
+template<typename T>
+struct fixed_layout<T, std::enable_if_t<std::is_arithmetic<T>::value>> {
+    static constexpr bool value = true;
+    static constexpr size_t rank = 0;
+    static constexpr size_t size = 1;
+    using element_type = T;
+    static constexpr size_t dim(size_t) { return 1; }
+    template<size_t K> static T& at(T& t) { return t; }
+    template<size_t K> static const T& at(const T& t) { return t; }
+};
+
+template<typename T>
+struct fixed_layout<std::complex<T>, std::enable_if_t<std::is_arithmetic<T>::value>> {
+    static constexpr bool value = true;
+    static constexpr size_t rank = 0;
+    static constexpr size_t size = 1;
+    using element_type = std::complex<T>;
+    static constexpr size_t dim(size_t) { return 1; }
+    template<size_t K> static element_type& at(element_type& t) { return t; }
+    template<size_t K> static const element_type& at(const element_type& t) { return t; }
+};
+
+template<typename T, size_t N>
+struct fixed_layout<std::array<T,N>, std::enable_if_t<fixed_layout<T>::value>> {
+    using inner = fixed_layout<T>;
+    static constexpr bool value = true;
+    static constexpr size_t rank = inner::rank + 1;
+    static constexpr size_t size = N * inner::size;
+    using element_type = typename inner::element_type;
+    static constexpr size_t dim(size_t i) { return i == 0 ? N : inner::dim(i-1); }
+    template<size_t K> static element_type& at(std::array<T,N>& a) {
+        return inner::template at<K / N>(a[K % N]);
+    }
+    template<size_t K> static const element_type& at(const std::array<T,N>& a) {
+        return inner::template at<K / N>(a[K % N]);
+    }
+};
+
+template<typename T, size_t R, size_t C>
+struct fixed_layout<fixed_matrix<T,R,C>, std::enable_if_t<(fixed_layout<T>::rank == 0 && fixed_layout<T>::value)>> {
+    static constexpr bool value = true;
+    static constexpr size_t rank = 2;
+    static constexpr size_t size = R * C;
+    using element_type = T;
+    static constexpr size_t dim(size_t i) { return i == 0 ? R : i == 1 ? C : 1; }
+    template<size_t K> static T& at(fixed_matrix<T,R,C>& m) { return m.data[K]; }
+    template<size_t K> static const T& at(const fixed_matrix<T,R,C>& m) { return m.data[K]; }
+};
+
+template<typename T>
+struct is_fixed_shape
+    : std::integral_constant<bool, fixed_layout<T>::value && (fixed_layout<T>::rank > 0)> {};
+} // namespace mexbind0x
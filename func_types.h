@@ -53,6 +53,23 @@ struct types_t {
     static constexpr int size = sizeof...(Args);
 };
 
+// Parameter types supplied by the library instead of being read from prhs.
+// Specializations derive from std::true_type and provide static T get().
+template<typename T, typename = void>
+struct injected_arg : std::false_type {};
+
+template<typename ... Args> struct count_consumed;
+template<> struct count_consumed<> : std::integral_constant<int,0> {};
+template<typename T, typename ... Args>
+struct count_consumed<T,Args...>
+    : std::integral_constant<int, !injected_arg<T>::value + count_consumed<Args...>::value> {};
+
+// Number of arguments read from prhs
+template<typename ... Args>
+constexpr int consumed_args(types_t<Args...>) {
+    return count_consumed<Args...>::value;
+}
+
 template<int i=0>
 types_t<> count_args(types_t<>) {
     return {};
@@ -69,7 +86,7 @@ tuple_cons(type_t<T>, types_t<Args...>) { return {}; }
 
 template<int i=0, typename T, typename T2, typename ... Args>
 auto count_args(types_t<T,T2,Args...>) {
-    auto tail = count_args<i+1>(types_t<T2,Args...>());
+    auto tail = count_args<i + !injected_arg<T>::value>(types_t<T2,Args...>());
     type_t<std::pair<T, std::integral_constant<int,i>>> head;
     return tuple_cons(head,tail);
 }
@@ -115,10 +132,18 @@ void deleter2(const T& arg)
     arg.~T();
 }
 
+template<typename ...>
+struct make_void { typedef void type; };
+template<typename ... Ts>
+using void_t = typename make_void<Ts...>::type;
+
+// Containers: a size() member function and a value_type
 template<typename T, typename = void>
 struct has_size : std::false_type {};
 template<typename T>
-struct has_size<T, std::enable_if_t<std::is_member_function_pointer<decltype(&T::size)>::value>> : std::true_type {};
+struct has_size<T, void_t<typename T::value_type,
+                          std::enable_if_t<std::is_member_function_pointer<decltype(&T::size)>::value>>>
+    : std::true_type {};
 template<typename T>
 constexpr bool has_size_v = has_size<T>::value;
 
@@ -155,6 +180,13 @@ void calc_null_ndvector_size(It it, const T *)
     calc_null_ndvector_size(++it, static_cast<const typename T::value_type*>(nullptr));
 }
 
+template<typename It, typename T, size_t sz>
+void calc_null_ndvector_size(It it, const T (*)[sz])
+{
+    *it = sz;
+    calc_null_ndvector_size(++it, static_cast<const T*>(nullptr));
+}
+
 void calc_ndvector_size(...) {}
 
 template<typename T, size_t sz, typename It>
@@ -0,0 +1,225 @@
+#pragma once
+// 16-bit floating point element types stored in uint16 arrays.
+// float16 is IEEE binary16, bfloat16 the upper half of a binary32.
+// Both bind to mxUINT16_CLASS: from_mx, to_mx, NDArrayView and mx_converter
+// take a uint16 array as the encoded values, other classes are converted numerically.
+// widen/narrow convert whole buffers with F16C or AVX-512 when compiled for them.
+#include "mex_cast.h"
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#if defined(__F16C__) || defined(__AVX2__) || defined(__AVX512F__)
+#include <immintrin.h>
+#endif
+
+namespace mexbind0x {
+inline uint32_t float_bits(float f) {
+    uint32_t x;
+    memcpy(&x, &f, sizeof(x));
+    return x;
+}
+
+inline float bits_float(uint32_t x) {
+    float f;
+    memcpy(&f, &x, sizeof(f));
+    return f;
+}
+
+// Round to nearest even, overflow to infinity, NaN stays NaN
+inline uint16_t float_to_half_bits(float f) {
+    uint32_t x = float_bits(f);
+    uint32_t sign = (x >> 16) & 0x8000;
+    uint32_t a = x & 0x7fffffff;
+    if (a >= 0x7f800000)
+        return sign | 0x7c00 | (a > 0x7f800000 ? 0x200 | ((a >> 13) & 0x3ff) : 0);
+    if (a >= 0x477ff000) // 65520 and above round to infinity
+        return sign | 0x7c00;
+    if (a < 0x38800000) { // below 2^-14: subnormal, rounded by adding 0.5 (ulp 2^-24)
+        uint32_t r = float_bits(bits_float(a) + 0.5f);
+        return sign | static_cast<uint16_t>(r - 0x3f000000);
+    }
+    a += 0xc8000fff + ((a >> 13) & 1); // rebias exponent by -112, round
+    return sign | static_cast<uint16_t>(a >> 13);
+}
+
+inline float half_bits_to_float(uint16_t h) {
+    uint32_t sign = static_cast<uint32_t>(h & 0x8000) << 16;
+    uint32_t e = (h >> 10) & 0x1f, m = h & 0x3ff;
+    if (e == 0x1f) // signalling NaNs are quieted, as F16C does
+        return bits_float(sign | 0x7f800000 | (m ? 0x400000 | (m << 13) : 0));
+    if (e)
+        return bits_float(sign | ((e + 112) << 23) | (m << 13));
+    return bits_float(sign | float_bits(m * (1.0f / 16777216.0f))); // m * 2^-24
+}
+
+inline uint16_t float_to_bfloat16_bits(float f) {
+    uint32_t x = float_bits(f);
+    uint32_t rounded = (x + 0x7fff + ((x >> 16) & 1)) >> 16;
+    uint32_t nan = (x >> 16) | 0x40;
+    return static_cast<uint16_t>((x & 0x7fffffff) > 0x7f800000 ? nan : rounded);
+}
+
+inline float bfloat16_bits_to_float(uint16_t h) {
+    return bits_float(static_cast<uint32_t>(h) << 16);
+}
+
+// A uint16_t is taken as the encoding, any other arithmetic value is converted
+struct float16 {
+    uint16_t bits;
+    float16() = default;
+    template<typename V, typename = std::enable_if_t<std::is_arithmetic<V>::value>>
+    explicit float16(V v) {
+        bits = std::is_same<V, uint16_t>::value ? static_cast<uint16_t>(v)
+                                                : float_to_half_bits(static_cast<float>(v));
+    }
+    operator float() const { return half_bits_to_float(bits); }
+};
+
+struct bfloat16 {
+    uint16_t bits;
+    bfloat16() = default;
+    template<typename V, typename = std::enable_if_t<std::is_arithmetic<V>::value>>
+    explicit bfloat16(V v) {
+        bits = std::is_same<V, uint16_t>::value ? static_cast<uint16_t>(v)
+                                                : float_to_bfloat16_bits(static_cast<float>(v));
+    }
+    operator float() const { return bfloat16_bits_to_float(bits); }
+};
+
+static_assert(sizeof(float16) == 2 && sizeof(bfloat16) == 2, "half types must be 16 bits");
+
+template<typename T> struct is_half_float : std::false_type {};
+template<> struct is_half_float<float16> : std::true_type {};
+template<> struct is_half_float<bfloat16> : std::true_type {};
+
+template<> struct get_mex_classid<float16> : std::integral_constant<mxClassID, mxUINT16_CLASS> {};
+template<> struct get_mex_classid<bfloat16> : std::integral_constant<mxClassID, mxUINT16_CLASS> {};
+
+inline void widen(const float16 *src, size_t n, float *dst) {
+    size_t i = 0;
+#ifdef __AVX512F__
+    for (; i + 16 <= n; i += 16)
+        _mm512_storeu_ps(dst + i, _mm512_cvtph_ps(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i))));
+#endif
+#ifdef __F16C__
+    for (; i + 8 <= n; i += 8)
+        _mm256_storeu_ps(dst + i, _mm256_cvtph_ps(_mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i))));
+#endif
+    for (; i < n; i++)
+        dst[i] = half_bits_to_float(src[i].bits);
+}
+
+inline void narrow(const float *src, size_t n, float16 *dst) {
+    size_t i = 0;
+#ifdef __AVX512F__
+    for (; i + 16 <= n; i += 16)
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i),
+                            _mm512_cvtps_ph(_mm512_loadu_ps(src + i), _MM_FROUND_TO_NEAREST_INT));
+#endif
+#ifdef __F16C__
+    for (; i + 8 <= n; i += 8)
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i),
+                         _mm256_cvtps_ph(_mm256_loadu_ps(src + i), _MM_FROUND_TO_NEAREST_INT));
+#endif
+    for (; i < n; i++)
+        dst[i].bits = float_to_half_bits(src[i]);
+}
+
+inline void widen(const bfloat16 *src, size_t n, float *dst) {
+    size_t i = 0;
+#ifdef __AVX512F__
+    for (; i + 16 <= n; i += 16) {
+        __m512i v = _mm512_cvtepu16_epi32(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i)));
+        _mm512_storeu_si512(dst + i, _mm512_slli_epi32(v, 16));
+    }
+#endif
+#ifdef __AVX2__
+    for (; i + 8 <= n; i += 8) {
+        __m256i v = _mm256_cvtepu16_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i)));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i), _mm256_slli_epi32(v, 16));
+    }
+#endif
+    for (; i < n; i++)
+        dst[i] = bfloat16_bits_to_float(src[i].bits);
+}
+
+// Without AVX512-BF16 the branch-free scalar loop is left to the auto-vectorizer.
+// AVX512-BF16 flushes subnormal inputs (below 1.2e-38) to zero.
+inline void narrow(const float *src, size_t n, bfloat16 *dst) {
+    size_t i = 0;
+#ifdef __AVX512BF16__
+    for (; i + 16 <= n; i += 16)
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i),
+                            (__m256i)_mm512_cvtneps_pbh(_mm512_loadu_ps(src + i)));
+#endif
+    for (; i < n; i++)
+        dst[i].bits = float_to_bfloat16_bits(src[i]);
+}
+
+// from_mx half scalars
+template<typename T>
+struct from_mx_visitor<T, std::enable_if_t<is_half_float<T>::value>> {
+    typedef T result_type;
+    template<typename V>
+        T run(const mxArray *m) {
+            if (!mxIsScalar(m)) throw std::invalid_argument("should be scalar");
+            if (mxIsComplex(m)) throw std::invalid_argument("should be real");
+            return T(*static_cast<const V*>(mxGetData(m)));
+        }
+};
+
+// Argument converted to float: a uint16 array is decoded as H with widen,
+// single is copied and other real classes are converted.
+template<typename H>
+struct widened {
+    static constexpr bool can_mex_cast = true;
+    std::vector<float> values;
+    std::vector<mwSize> dims;
+
+    widened(const mxArray *m)
+        : values(mxGetNumberOfElements(m)),
+          dims(mxGetDimensions(m), mxGetDimensions(m) + mxGetNumberOfDimensions(m)) {
+        if (mxIsComplex(m) || mxIsSparse(m))
+            throw std::invalid_argument("should be real and full");
+        size_t n = values.size();
+        if (!n) return;
+        if (mxGetClassID(m) == mxUINT16_CLASS)
+            widen(static_cast<const H*>(mxGetData(m)), n, values.data());
+        else if (mxGetClassID(m) == mxSINGLE_CLASS)
+            memcpy(values.data(), mxGetData(m), n * sizeof(float));
+        else
+            make_mx_converter<float>(m).gather(mxGetData(m), 0, 1, n, values.data());
+    }
+
+    size_t size() const { return values.size(); }
+    float *data() { return values.data(); }
+    const float *data() const { return values.data(); }
+    float &operator[](size_t i) { return values[i]; }
+    const float &operator[](size_t i) const { return values[i]; }
+};
+
+// Output computed in float and returned as a uint16 array of H, narrowed in one pass
+template<typename H>
+struct narrowed {
+    std::vector<float> values;
+    std::vector<mwSize> dims;
+
+    narrowed() = default;
+    explicit narrowed(std::vector<float> v) : values(std::move(v)), dims{values.size(), 1} {}
+    narrowed(std::vector<float> v, std::vector<mwSize> d) : values(std::move(v)), dims(std::move(d)) {}
+    narrowed(widened<H> &&w) : values(std::move(w.values)), dims(std::move(w.dims)) {}
+};
+
+template<typename H>
+mxArray *to_mx(const narrowed<H> &arg) {
+    size_t total = 1;
+    for (auto d : arg.dims) total *= d;
+    if (total != arg.values.size())
+        throw std::invalid_argument(stringer("narrowed: ", arg.values.size(),
+                                             " values do not match the dimensions"));
+    mxArray *res = mxCreateNumericArray(arg.dims.size(), arg.dims.data(), mxUINT16_CLASS, mxREAL);
+    if (total)
+        narrow(arg.values.data(), total, static_cast<H*>(mxGetData(res)));
+    return res;
+}
+} // namespace mexbind0x
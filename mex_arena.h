@@ -0,0 +1,210 @@
+#pragma once
+#include "func_types.h"
+#include "mex_lifecycle.h"
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+#include <string>
+#include <vector>
+#if __cplusplus >= 201703L
+#include <memory_resource>
+#endif
+
+namespace mexbind0x {
+// Monotonic bump allocator for temporaries of a single mexFunction call.
+// Memory is only released by reset(), which keeps the blocks for the next call:
+// if the call needed several blocks they are merged into one of the combined size,
+// so steady state is a single allocation. Blocks above the retained limit are freed.
+// Not thread-safe, meant for the MATLAB thread.
+class scratch_arena {
+    struct block {
+        char *data;
+        size_t size;
+    };
+    std::vector<block> blocks;
+    size_t used = 0;            // in blocks.back()
+    size_t retained = 16 << 20;
+    size_t peak = 0;
+
+    static constexpr size_t min_block = 64 << 10;
+
+    void add_block(size_t size) {
+        char *p = static_cast<char*>(std::malloc(size));
+        if (!p) throw std::bad_alloc();
+        blocks.push_back({p, size});
+        used = 0;
+    }
+
+    void free_blocks() {
+        for (auto &b : blocks) std::free(b.data);
+        blocks.clear();
+        used = 0;
+    }
+public:
+    scratch_arena() = default;
+    scratch_arena(const scratch_arena&) = delete;
+    scratch_arena& operator=(const scratch_arena&) = delete;
+
+    ~scratch_arena() {
+        free_blocks();
+    }
+
+    void *allocate(size_t bytes, size_t align = alignof(std::max_align_t)) {
+        if (!blocks.empty()) {
+            uintptr_t base = reinterpret_cast<uintptr_t>(blocks.back().data);
+            size_t offset = ((base + used + align - 1) & ~(uintptr_t)(align - 1)) - base;
+            if (offset + bytes <= blocks.back().size) {
+                used = offset + bytes;
+                return blocks.back().data + offset;
+            }
+        }
+        size_t last = blocks.empty() ? 0 : blocks.back().size;
+        size_t smallest = min_block;
+        add_block(std::max({smallest, 2*last, bytes + align}));
+        return allocate(bytes, align);
+    }
+
+    // Bytes handed out since the last reset
+    size_t bytes_used() const {
+        size_t res = used;
+        for (size_t i=0; i+1<blocks.size(); i++) res += blocks[i].size;
+        return res;
+    }
+
+    size_t capacity() const {
+        size_t res = 0;
+        for (auto &b : blocks) res += b.size;
+        return res;
+    }
+
+    size_t peak_bytes() const {
+        return peak;
+    }
+
+    void set_retained(size_t bytes) {
+        retained = bytes;
+    }
+
+    void reset() {
+        peak = std::max(peak, bytes_used());
+        size_t total = capacity();
+        if (blocks.size() > 1 || total > retained) {
+            free_blocks();
+            if (total <= retained)
+                add_block(total);
+        }
+        used = 0;
+    }
+};
+
+// The arena reset at the end of every mexFunction call
+inline scratch_arena& mex_arena() {
+    static scratch_arena *arena = nullptr;
+    if (!arena) {
+        arena = new scratch_arena();
+        at_mex_exit([] { delete arena; arena = nullptr; });
+    }
+    return *arena;
+}
+
+inline int& arena_scope_depth() {
+    static int depth = 0;
+    return depth;
+}
+
+// Numbers the mexFunction calls, incremented when the outermost arena_scope starts
+inline uint64_t& mex_call_number() {
+    static uint64_t number = 0;
+    return number;
+}
+
+// Resets mex_arena() when the outermost scope ends.
+// MXCommands and MEX_WRAP hold one for the duration of the call.
+struct arena_scope {
+    arena_scope() {
+        if (arena_scope_depth()++ == 0)
+            mex_call_number()++;
+    }
+    ~arena_scope() {
+        if (--arena_scope_depth() == 0)
+            mex_arena().reset();
+    }
+    arena_scope(const arena_scope&) = delete;
+    arena_scope& operator=(const arena_scope&) = delete;
+};
+
+template<typename T>
+struct arena_allocator {
+    using value_type = T;
+    scratch_arena *arena;
+
+    arena_allocator() : arena(&mex_arena()) {}
+    arena_allocator(scratch_arena &arena) : arena(&arena) {}
+    template<typename U>
+    arena_allocator(const arena_allocator<U> &o) : arena(o.arena) {}
+
+    T *allocate(size_t n) {
+        if (n > SIZE_MAX / sizeof(T)) throw std::bad_alloc();
+        return static_cast<T*>(arena->allocate(n * sizeof(T), alignof(T)));
+    }
+
+    void deallocate(T*, size_t) {}
+
+    template<typename U>
+    bool operator==(const arena_allocator<U> &o) const { return arena == o.arena; }
+    template<typename U>
+    bool operator!=(const arena_allocator<U> &o) const { return arena != o.arena; }
+};
+
+template<typename T>
+using scratch_vector = std::vector<T, arena_allocator<T>>;
+using scratch_string = std::basic_string<char, std::char_traits<char>, arena_allocator<char>>;
+
+#ifdef __cpp_lib_memory_resource
+class arena_resource : public std::pmr::memory_resource {
+    scratch_arena *arena;
+
+    void *do_allocate(size_t bytes, size_t align) override {
+        return arena->allocate(bytes, align);
+    }
+    void do_deallocate(void*, size_t, size_t) override {}
+    bool do_is_equal(const std::pmr::memory_resource &o) const noexcept override {
+        return this == &o;
+    }
+public:
+    arena_resource(scratch_arena &arena = mex_arena()) : arena(&arena) {}
+};
+#endif
+
+// Parameter type giving a user function access to the per-call arena,
+// it does not consume an input argument:
+//   m.on("f", [](scratch s, std::vector<double> x) { scratch_vector<double> tmp(s.allocator<double>()); ... });
+struct scratch {
+    scratch_arena *arena;
+
+    template<typename T>
+    arena_allocator<T> allocator() const {
+        return arena_allocator<T>(*arena);
+    }
+
+    template<typename T>
+    T *allocate(size_t n) const {
+        return allocator<T>().allocate(n);
+    }
+
+#ifdef __cpp_lib_memory_resource
+    arena_resource resource() const {
+        return arena_resource(*arena);
+    }
+#endif
+};
+
+template<>
+struct injected_arg<scratch> : std::true_type {
+    static scratch get() {
+        return {&mex_arena()};
+    }
+};
+} // namespace mexbind0x
@@ -1,63 +1,202 @@
 #pragma once
 #include "mex_cast.h"
+#include <array>
 #include <complex>
 #include <stdexcept>
+#include <vector>
 
 namespace mexbind0x {
+// Stride 0 repeats the element at first
+template<typename T>
+void mx_gather(const mx_converter<T> &conv, const void *data, size_t numel,
+               size_t first, size_t stride, size_t count, T *dst) {
+    if (count == 0) return;
+    if (first >= numel || (stride && (numel - 1 - first) / stride < count - 1))
+        throw std::out_of_range("gather range out of bounds");
+    conv.gather(data, first, stride, count, dst);
+}
+
+// Converters to T for every class, built once per T, so that element accessors
+// index a table instead of switching on the class
+template<typename T>
+const mx_converter<T>& class_converter(mxClassID id) {
+    static const std::array<mx_converter<T>, 32> table = [] {
+        std::array<mx_converter<T>, 32> t{};
+        const mxClassID ids[] = {mxINT8_CLASS, mxUINT8_CLASS, mxINT16_CLASS, mxUINT16_CLASS,
+                                 mxINT32_CLASS, mxUINT32_CLASS, mxINT64_CLASS, mxUINT64_CLASS,
+                                 mxSINGLE_CLASS, mxDOUBLE_CLASS, mxCHAR_CLASS, mxLOGICAL_CLASS};
+        for (mxClassID c : ids)
+            if (static_cast<size_t>(c) < t.size())
+                t[c] = mex_visit_class(mx_converter_visitor<T>(), c, nullptr);
+        return t;
+    }();
+    if (static_cast<size_t>(id) >= table.size() || !table[id].get)
+        throw std::invalid_argument("numeric array expected");
+    return table[id];
+}
+
+// Class, data pointers and dimensions are read once on construction,
+// element accessors dispatch on the cached class only.
 struct MXArray {
     const mxArray *m;
+    mxClassID id;
+    const void *real;
+    const void *imag;
+    const mwSize *dim;
+    size_t ndim;
+    size_t numel;
     MXArray(const mxArray *m) : m(m) {
         if (!mxIsNumeric(m))
             throw std::invalid_argument("numeric array expected");
+        id = mxGetClassID(m);
+        real = mxGetData(m);
+        imag = mxGetImagData(m);
+        dim = mxGetDimensions(m);
+        ndim = mxGetNumberOfDimensions(m);
+        numel = mxGetNumberOfElements(m);
     }
     static constexpr bool can_mex_cast = true;
 
+    template<typename T>
+    const mx_converter<T>& converter() const {
+        return class_converter<T>(id);
+    }
+
     template<typename T, typename ... Args>
-    T get (Args ... args) {
-        const mwSize *dim = mxGetDimensions(m);
-        int n = mxGetNumberOfDimensions(m);
-        int idx = get_idx(n,dim,args...);
-        return cast_ptr_complex<T>(m, idx);
+    T get (Args ... args) const {
+        return element<T>(get_idx(args...));
     }
 
     template<typename T>
-        T get1(size_t idx) {
-            return cast_ptr<T>(m, mxGetData(m), idx);
+        T get1(size_t idx) const {
+            return converter<T>().get(real, idx);
         }
 
     template<typename T, typename ... Args>
-    T geti (Args ... args) {
-        const mwSize *dim = mxGetDimensions(m);
-        int n = mxGetNumberOfDimensions(m);
-        int idx = get_idx(n,dim,args...);
-        return cast_ptr<T>(m, mxGetImagData(m), idx);
+    T geti (Args ... args) const {
+        size_t idx = get_idx(args...);
+        return imag ? converter<T>().get(imag, idx) : T();
     }
 
-    int get_idx(int n, const mwSize*) {
-        if (n != 0)
-            throw std::out_of_range("bad number of dimensions");
-        return 0;
+    template<typename ... Args>
+        size_t get_idx(Args ... args) const {
+            if (sizeof...(args) != ndim)
+                throw std::out_of_range("bad number of dimensions");
+            const size_t idx[sizeof...(args)+1] = {static_cast<size_t>(args)..., 0};
+            size_t res = 0, mult = 1;
+            for (size_t i=0; i<ndim; i++) {
+                if (idx[i] >= dim[i])
+                    throw std::out_of_range("MXArray index out of range");
+                res += idx[i] * mult;
+                mult *= dim[i];
+            }
+            return res;
+        }
+
+    template<typename T>
+    std::enable_if_t<!is_complex<T>::value,T> element(size_t idx) const {
+        return converter<T>().get(real, idx);
     }
 
-    template<typename T, typename ... Args>
-        int get_idx(int n, const mwSize* dim, T t, Args ... args) {
-            if (t < 0 || t >= *dim)
-                throw std::out_of_range("MXArray index out of range");
-            return t + *dim * get_idx(n-1, dim+1, args...);
-        }
+    template<typename T>
+    std::enable_if_t<is_complex<T>::value,T> element(size_t idx) const {
+        using V = typename T::value_type;
+        const auto &conv = converter<V>();
+        return T(conv.get(real, idx), imag ? conv.get(imag, idx) : V());
+    }
+
+    size_t size() const {
+        return numel;
+    }
+
+    template<typename T>
+    void copy_to(T *dst, size_t count) const {
+        if (count < numel)
+            throw std::out_of_range("copy_to destination is too small");
+        mx_gather(converter<T>(), real, numel, 0, 1, numel, dst);
+    }
+
+    template<typename C>
+    auto copy_to(C &&dst) const -> decltype(dst.data(), dst.size(), void()) {
+        copy_to(dst.data(), dst.size());
+    }
+
+    template<typename T>
+    void gather(size_t first, size_t stride, size_t count, T *dst) const {
+        mx_gather(converter<T>(), real, numel, first, stride, count, dst);
+    }
+
+    template<typename T>
+    std::vector<T> row(size_t i) const {
+        size_t rows = dim[0];
+        if (i >= rows)
+            throw std::out_of_range("MXArray row out of range");
+        std::vector<T> res(numel / rows);
+        gather(i, rows, res.size(), res.data());
+        return res;
+    }
+
+    template<typename T>
+    std::vector<T> col(size_t j) const {
+        size_t rows = dim[0];
+        if (rows == 0 || j >= numel / rows)
+            throw std::out_of_range("MXArray column out of range");
+        std::vector<T> res(rows);
+        gather(j * rows, 1, rows, res.data());
+        return res;
+    }
 };
 
 template<typename T>
 struct MXTyped1DArray {
+    using elem_type = typename remove_complex<T>::type;
     const mxArray *m;
+    mx_converter<elem_type> conv;
+    const void *real;
+    const void *imag;
+    size_t numel;
     static constexpr bool can_mex_cast = true;
     MXTyped1DArray(const mxArray *m) : m(m) {
         if (!mxIsNumeric(m))
             throw std::invalid_argument("numeric array expected");
+        conv = make_mx_converter<elem_type>(m);
+        real = mxGetData(m);
+        imag = mxGetImagData(m);
+        numel = mxGetNumberOfElements(m);
+    }
+
+    T operator[](size_t idx) const {
+        return element(idx, is_complex<T>());
+    }
+
+    size_t size() const {
+        return numel;
+    }
+
+    void copy_to(T *dst, size_t count) const {
+        static_assert(!is_complex<T>::value, "copy_to supports real element types only");
+        if (count < numel)
+            throw std::out_of_range("copy_to destination is too small");
+        mx_gather(conv, real, numel, 0, 1, numel, dst);
+    }
+
+    template<typename C>
+    auto copy_to(C &&dst) const -> decltype(dst.data(), dst.size(), void()) {
+        copy_to(dst.data(), dst.size());
+    }
+
+    void gather(size_t first, size_t stride, size_t count, T *dst) const {
+        static_assert(!is_complex<T>::value, "gather supports real element types only");
+        mx_gather(conv, real, numel, first, stride, count, dst);
+    }
+
+private:
+    T element(size_t idx, std::false_type) const {
+        return conv.get(real, idx);
     }
 
-    T operator[](int idx) {
-        return cast_ptr_complex<T>(m,idx);
+    T element(size_t idx, std::true_type) const {
+        return T(conv.get(real, idx), imag ? conv.get(imag, idx) : elem_type());
     }
 };
 } // namespace mexbind0x
@@ -0,0 +1,477 @@
+#pragma once
+#include "mex_lifecycle.h"
+#include "mex_cast.h"
+#include <mex.h>
+#include <cstdint>
+#include <cstring>
+#include <list>
+#include <memory>
+#include <string>
+#include <typeindex>
+#include <typeinfo>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace mexbind0x {
+// Non-cryptographic 64-bit hashing of raw MATLAB data
+inline uint64_t hash_mix(uint64_t h, uint64_t v) {
+    h ^= v * 0x9E3779B97F4A7C15ULL;
+    h = (h << 31) | (h >> 33);
+    return h * 0xBF58476D1CE4E5B9ULL;
+}
+
+inline uint64_t hash_bytes(const void *data, size_t n, uint64_t seed) {
+    const unsigned char *p = static_cast<const unsigned char*>(data);
+    uint64_t lanes[4] = {seed, seed ^ 0x94D049BB133111EBULL, seed + n, ~seed};
+    uint64_t v[4];
+    for (; n >= sizeof(v); n -= sizeof(v), p += sizeof(v)) {
+        memcpy(v, p, sizeof(v));
+        for (int i=0; i<4; i++) lanes[i] = hash_mix(lanes[i], v[i]);
+    }
+    for (; n >= 8; n -= 8, p += 8) {
+        memcpy(v, p, 8);
+        lanes[0] = hash_mix(lanes[0], v[0]);
+    }
+    uint64_t tail = 0;
+    memcpy(&tail, p, n);
+    uint64_t h = hash_mix(lanes[0], tail);
+    for (int i=1; i<4; i++) h = hash_mix(h, lanes[i]);
+    return h;
+}
+
+// Hashes class, dimensions and contents. Returns false for arrays that
+// cannot be hashed by value (sparse, function handles, objects).
+inline bool hash_mx(const mxArray *m, uint64_t &h) {
+    if (!m) {
+        h = hash_mix(h, 0);
+        return true;
+    }
+    mxClassID id = mxGetClassID(m);
+    size_t nd = mxGetNumberOfDimensions(m);
+    h = hash_mix(h, id);
+    h = hash_bytes(mxGetDimensions(m), nd*sizeof(mwSize), h);
+    size_t n = mxGetNumberOfElements(m);
+    switch (id) {
+        case mxCELL_CLASS:
+            for (size_t i=0; i<n; i++)
+                if (!hash_mx(mxGetCell(m, i), h)) return false;
+            return true;
+        case mxSTRUCT_CLASS: {
+            int nf = mxGetNumberOfFields(m);
+            for (int f=0; f<nf; f++) {
+                const char *name = mxGetFieldNameByNumber(m, f);
+                h = hash_bytes(name, strlen(name), h);
+            }
+            for (size_t i=0; i<n; i++)
+                for (int f=0; f<nf; f++)
+                    if (!hash_mx(mxGetFieldByNumber(m, i, f), h)) return false;
+            return true;
+        }
+        case mxFUNCTION_CLASS:
+        case mxUNKNOWN_CLASS:
+        case mxVOID_CLASS:
+            return false;
+        default:
+            if (mxIsSparse(m) || !(mxIsNumeric(m) || mxIsChar(m) || mxIsLogical(m)))
+                return false;
+            h = hash_mix(h, mxIsComplex(m));
+            h = hash_bytes(mxGetData(m), n*mxGetElementSize(m), h);
+            if (mxIsComplex(m))
+                h = hash_bytes(mxGetImagData(m), n*mxGetElementSize(m), h);
+            return true;
+    }
+}
+
+// Same class, dimensions and contents, for the arrays hash_mx accepts
+inline bool mx_same(const mxArray *a, const mxArray *b) {
+    if (!a || !b) return a == b;
+    mxClassID id = mxGetClassID(a);
+    size_t nd = mxGetNumberOfDimensions(a);
+    if (id != mxGetClassID(b) || nd != mxGetNumberOfDimensions(b)
+            || memcmp(mxGetDimensions(a), mxGetDimensions(b), nd*sizeof(mwSize)))
+        return false;
+    size_t n = mxGetNumberOfElements(a);
+    switch (id) {
+        case mxCELL_CLASS:
+            for (size_t i=0; i<n; i++)
+                if (!mx_same(mxGetCell(a, i), mxGetCell(b, i))) return false;
+            return true;
+        case mxSTRUCT_CLASS: {
+            int nf = mxGetNumberOfFields(a);
+            if (nf != mxGetNumberOfFields(b)) return false;
+            for (int f=0; f<nf; f++)
+                if (strcmp(mxGetFieldNameByNumber(a, f), mxGetFieldNameByNumber(b, f))) return false;
+            for (size_t i=0; i<n; i++)
+                for (int f=0; f<nf; f++)
+                    if (!mx_same(mxGetFieldByNumber(a, i, f), mxGetFieldByNumber(b, i, f))) return false;
+            return true;
+        }
+        default: {
+            if (mxIsSparse(a) || mxIsSparse(b) || mxIsComplex(a) != mxIsComplex(b))
+                return false;
+            size_t bytes = n*mxGetElementSize(a);
+            if (!bytes) return true;
+            return !memcmp(mxGetData(a), mxGetData(b), bytes)
+                && (!mxIsComplex(a) || !memcmp(mxGetImagData(a), mxGetImagData(b), bytes));
+        }
+    }
+}
+
+// Approximate memory held by an mxArray
+inline size_t mx_bytes(const mxArray *m) {
+    const size_t header = 64;
+    if (!m) return 0;
+    size_t n = mxGetNumberOfElements(m);
+    size_t res = header;
+    if (mxIsCell(m)) {
+        for (size_t i=0; i<n; i++) res += sizeof(void*) + mx_bytes(mxGetCell(m, i));
+    } else if (mxIsStruct(m)) {
+        int nf = mxGetNumberOfFields(m);
+        for (size_t i=0; i<n; i++)
+            for (int f=0; f<nf; f++) res += sizeof(void*) + mx_bytes(mxGetFieldByNumber(m, i, f));
+    } else {
+        res += n * mxGetElementSize(m) * (mxIsComplex(m) ? 2 : 1);
+    }
+    return res;
+}
+
+// Least recently used cache bounded by the total size of its values in bytes
+template<typename Key, typename Value, typename Hash = std::hash<Key>>
+class lru_cache {
+    struct entry {
+        Key key;
+        Value value;
+        size_t bytes;
+    };
+    std::list<entry> items;
+    std::unordered_map<Key, typename std::list<entry>::iterator, Hash> index;
+    size_t used = 0;
+    size_t budget;
+    cache_budget *shared = nullptr;
+    std::string stat_names[3]; // hits, misses, evictions in runtime_stats(), if set
+
+    void count(int which) {
+        if (!stat_names[which].empty()) runtime_stats().add(stat_names[which], 1);
+    }
+
+    void add_used(size_t bytes) {
+        used += bytes;
+        if (shared) shared->charge(bytes);
+    }
+
+    void sub_used(size_t bytes) {
+        used -= bytes;
+        if (shared) shared->discharge(bytes);
+    }
+public:
+    size_t hits = 0;
+    size_t misses = 0;
+    size_t evictions = 0;
+
+    explicit lru_cache(size_t budget) : budget(budget) {}
+    lru_cache(const lru_cache&) = delete;
+    lru_cache& operator=(const lru_cache&) = delete;
+
+    ~lru_cache() {
+        if (shared) shared->discharge(used);
+    }
+
+    // Also evict while the total of all caches sharing b is over its limit
+    void share_budget(cache_budget &b) {
+        if (shared) shared->discharge(used);
+        shared = &b;
+        shared->charge(used);
+        shrink();
+    }
+
+    // Also adds hits, misses and evictions to runtime_stats() as prefix_hits, ...
+    void record_stats(const std::string &prefix) {
+        stat_names[0] = prefix + "_hits";
+        stat_names[1] = prefix + "_misses";
+        stat_names[2] = prefix + "_evictions";
+    }
+
+    Value *find(const Key &key) {
+        return find(key, [](const Value &) { return true; });
+    }
+
+    // A hit only if accept(value) also holds, e.g. to tell colliding hashes apart
+    template<typename Pred>
+    Value *find(const Key &key, Pred accept) {
+        auto it = index.find(key);
+        if (it == index.end() || !accept(it->second->value)) {
+            misses++;
+            count(1);
+            return nullptr;
+        }
+        hits++;
+        count(0);
+        items.splice(items.begin(), items, it->second);
+        return &it->second->value;
+    }
+
+    // Values larger than the whole budget are not stored
+    void insert(const Key &key, Value value, size_t bytes) {
+        erase(key);
+        if (bytes > budget) return;
+        items.push_front(entry{key, std::move(value), bytes});
+        index.emplace(key, items.begin());
+        add_used(bytes);
+        shrink();
+    }
+
+    bool erase(const Key &key) {
+        auto it = index.find(key);
+        if (it == index.end()) return false;
+        sub_used(it->second->bytes);
+        items.erase(it->second);
+        index.erase(it);
+        return true;
+    }
+
+    template<typename Pred>
+    size_t erase_if(Pred pred) {
+        size_t n = 0;
+        for (auto it = items.begin(); it != items.end();)
+            if (pred(it->key, it->value)) {
+                sub_used(it->bytes);
+                index.erase(it->key);
+                it = items.erase(it);
+                n++;
+            } else ++it;
+        return n;
+    }
+
+    void clear() {
+        index.clear();
+        items.clear();
+        sub_used(used);
+        hits = misses = evictions = 0;
+    }
+
+    void set_budget(size_t bytes) {
+        budget = bytes;
+        shrink();
+    }
+
+    size_t get_budget() const { return budget; }
+    size_t bytes() const { return used; }
+    size_t size() const { return items.size(); }
+
+private:
+    void shrink() {
+        while ((used > budget || (shared && shared->over())) && !items.empty()) {
+            sub_used(items.back().bytes);
+            index.erase(items.back().key);
+            items.pop_back();
+            evictions++;
+            count(2);
+        }
+    }
+};
+
+// Persistent copies of command inputs or outputs, destroyed together with the cache entry
+class persistent_arrays {
+    std::vector<mxArray*> arrays;
+public:
+    persistent_arrays(const mxArray *const src[], size_t n) : arrays(n) {
+        for (size_t i=0; i<n; i++)
+            if (src[i]) {
+                arrays[i] = mxDuplicateArray(src[i]);
+                mexMakeArrayPersistent(arrays[i]);
+            }
+    }
+    persistent_arrays(const persistent_arrays&) = delete;
+    persistent_arrays(persistent_arrays &&o) : arrays(std::move(o.arrays)) {
+        o.arrays.clear();
+    }
+    ~persistent_arrays() {
+        for (auto a : arrays)
+            if (a) mxDestroyArray(a);
+    }
+
+    // Fresh copies that MATLAB may own
+    void copy_to(mxArray *dst[]) const {
+        for (size_t i=0; i<arrays.size(); i++)
+            dst[i] = arrays[i] ? mxDuplicateArray(arrays[i]) : nullptr;
+    }
+
+    size_t bytes() const {
+        size_t res = 0;
+        for (auto a : arrays) res += mx_bytes(a);
+        return res;
+    }
+
+    // Whether src holds the same n arrays
+    bool same(const mxArray *const src[], size_t n) const {
+        if (n != arrays.size()) return false;
+        for (size_t i=0; i<n; i++)
+            if (!mx_same(arrays[i], src[i])) return false;
+        return true;
+    }
+};
+
+// Outputs of a memoized call and the inputs they were computed from,
+// compared on a hit so that a hash collision is a miss
+struct memo_entry {
+    persistent_arrays inputs;
+    persistent_arrays outputs;
+    size_t bytes() const { return inputs.bytes() + outputs.bytes(); }
+};
+
+struct memo_key {
+    std::string command;
+    uint64_t hash;
+    unsigned nargout;
+    bool operator==(const memo_key &o) const {
+        return hash == o.hash && nargout == o.nargout && command == o.command;
+    }
+};
+
+struct memo_key_hash {
+    size_t operator()(const memo_key &k) const {
+        return static_cast<size_t>(hash_mix(k.hash, k.nargout));
+    }
+};
+
+using memo_cache_t = lru_cache<memo_key, memo_entry, memo_key_hash>;
+
+// Results of MXCommands::on_memoized, kept until the MEX file is cleared
+inline memo_cache_t& memo_cache() {
+    static memo_cache_t *cache = nullptr;
+    if (!cache) {
+        acquire_runtime();
+        cache = new memo_cache_t(256 << 20);
+        cache->share_budget(runtime_cache_budget());
+        cache->record_stats("memo");
+        at_mex_exit([] { delete cache; cache = nullptr; });
+    }
+    return *cache;
+}
+
+inline mxArray *cache_stats_struct(size_t entries, size_t bytes, size_t budget,
+                                   size_t hits, size_t misses, size_t evictions) {
+    const char *fields[] = {"entries", "bytes", "budget", "hits", "misses", "evictions"};
+    const size_t values[] = {entries, bytes, budget, hits, misses, evictions};
+    mxArray *res = mxCreateStructMatrix(1, 1, 6, fields);
+    for (int i=0; i<6; i++)
+        mxSetFieldByNumber(res, 0, i, mxCreateDoubleScalar(static_cast<double>(values[i])));
+    return res;
+}
+// Cheap content fingerprint: both ends of the data and evenly spaced samples.
+// Falls back to hashing everything for small, cell and struct arrays.
+inline bool mx_fingerprint(const mxArray *m, uint64_t &h) {
+    const size_t edge = 1024, samples = 64;
+    if (!(mxIsNumeric(m) || mxIsChar(m) || mxIsLogical(m)) || mxIsSparse(m))
+        return hash_mx(m, h);
+    size_t bytes = mxGetNumberOfElements(m) * mxGetElementSize(m);
+    const char *data = static_cast<const char*>(mxGetData(m));
+    if (bytes <= 2*edge + samples*8)
+        return hash_mx(m, h);
+    h = hash_bytes(data, edge, h);
+    h = hash_bytes(data + bytes - edge, edge, h);
+    size_t step = (bytes - 2*edge) / samples;
+    for (size_t i=0; i<samples; i++)
+        h = hash_bytes(data + edge + i*step, 8, h);
+    return true;
+}
+
+struct cached_key {
+    const void *data;
+    mxClassID id;
+    size_t numel;
+    uint64_t shape;
+    uint64_t content;
+    std::type_index type; // compared exactly, the value is cast back to it
+    bool operator==(const cached_key &o) const {
+        return data == o.data && id == o.id && numel == o.numel && shape == o.shape
+            && content == o.content && type == o.type;
+    }
+};
+
+struct cached_key_hash {
+    size_t operator()(const cached_key &k) const {
+        return static_cast<size_t>(hash_mix(hash_mix(reinterpret_cast<uintptr_t>(k.data), k.content),
+                                            std::hash<std::type_index>()(k.type)));
+    }
+};
+
+using cached_store_t = lru_cache<cached_key, std::shared_ptr<const void>, cached_key_hash>;
+
+// Converted arguments of cached<T>, kept until the MEX file is cleared
+inline cached_store_t& cached_store() {
+    static cached_store_t *store = nullptr;
+    if (!store) {
+        acquire_runtime();
+        store = new cached_store_t(512 << 20);
+        store->share_budget(runtime_cache_budget());
+        store->record_stats("cached");
+        at_mex_exit([] { delete store; store = nullptr; });
+    }
+    return *store;
+}
+
+// Drops converted copies of the array with the given data
+inline size_t invalidate_cached(const mxArray *m) {
+    const void *data = mxGetData(m);
+    return cached_store().erase_if([data](const cached_key &k, const std::shared_ptr<const void> &) {
+        return k.data == data;
+    });
+}
+
+// The version of struct('data', array, 'version', v) passed to cached<T>, or null
+inline const mxArray *cached_version(const mxArray *m) {
+    if (!mxIsStruct(m) || mxGetNumberOfElements(m) != 1 || mxGetNumberOfFields(m) != 2)
+        return nullptr;
+    if (mxGetFieldNumber(m, "data") < 0 || mxGetFieldNumber(m, "version") < 0)
+        return nullptr;
+    const mxArray *version = mxGetField(m, 0, "version");
+    if (!version || !mxIsNumeric(version) || !mxIsScalar(version))
+        throw std::invalid_argument("cached version should be a numeric scalar");
+    return version;
+}
+
+// Argument wrapper that keeps the converted T between calls.
+// The key is the MATLAB data pointer, class, dimensions and a content fingerprint.
+// Pass struct('data', array, 'version', v) instead of array to key on a version
+// number instead of the fingerprint, e.g. when the array is modified in place.
+template<typename T>
+class cached {
+    std::shared_ptr<const T> value;
+public:
+    static constexpr bool can_mex_cast = true;
+    cached(const mxArray *m) {
+        const mxArray *array = m;
+        uint64_t content = 0;
+        bool keyed;
+        if (const mxArray *v = cached_version(m)) {
+            array = mxGetField(m, 0, "data");
+            double version = from_mx<double>(v);
+            content = hash_bytes(&version, sizeof(version), 1);
+            keyed = array != nullptr;
+        } else keyed = mx_fingerprint(array, content);
+        if (!keyed) {
+            value = std::make_shared<const T>(from_mx<T>(array));
+            return;
+        }
+        size_t nd = mxGetNumberOfDimensions(array);
+        cached_key key{mxGetData(array), mxGetClassID(array), mxGetNumberOfElements(array),
+                       hash_bytes(mxGetDimensions(array), nd*sizeof(mwSize), 0),
+                       content, std::type_index(typeid(T))};
+        auto &store = cached_store();
+        if (auto *hit = store.find(key)) {
+            value = std::static_pointer_cast<const T>(*hit);
+            return;
+        }
+        value = std::make_shared<const T>(from_mx<T>(array));
+        size_t bytes = sizeof(T) + mxGetNumberOfElements(array) * sizeof(ndvector_value_type_t<T>);
+        store.insert(key, value, bytes);
+    }
+
+    const T& get() const { return *value; }
+    operator const T&() const { return *value; }
+    const T& operator*() const { return *value; }
+    const T* operator->() const { return value.get(); }
+};
+} // namespace mexbind0x
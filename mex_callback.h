@@ -0,0 +1,210 @@
+#pragma once
+#include "mex_cast.h"
+#include "trace.h"
+#include <mex.h>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <tuple>
+
+namespace mexbind0x {
+template<typename Signature>
+class matlab_callback;
+
+// Function handle argument that may be called from any thread.
+// Calls from other threads are queued and evaluated by the MATLAB thread inside serve(),
+// the caller gets a future. Calls on the MATLAB thread are evaluated directly.
+//
+// With set_batch(n), n > 1, the handle is treated as vectorised: up to n queued calls
+// are evaluated in one mexCallMATLAB, the arguments of each call concatenated as columns
+// and the result split back by columns. Calls whose arguments are not real numeric
+// column vectors of equal shape, or batches that fail, are evaluated one by one.
+template<typename R, typename... Args>
+class matlab_callback<R(Args...)> {
+    static_assert(!std::is_void<R>::value, "matlab_callback must return a value");
+
+    struct request {
+        std::tuple<std::decay_t<Args>...> args;
+        std::promise<R> result;
+    };
+
+    struct queue {
+        std::mutex mutex;
+        std::condition_variable cv;
+        std::deque<request> pending;
+    };
+
+    mxArray *handle;
+    std::thread::id owner;
+    size_t max_batch = 1;
+    std::shared_ptr<queue> q;
+
+    template<size_t... I>
+    static void args_to_mx(const std::tuple<std::decay_t<Args>...> &args, mxArray **out,
+                           std::index_sequence<I...>) {
+        (void)std::initializer_list<int>{(out[I] = to_mx(std::get<I>(args)), 0)...};
+    }
+
+    // feval(handle, in...), MATLAB errors are rethrown as C++ exceptions
+    mxArray *feval(mxArray **in) const {
+        trace_span span("callback", "feval");
+        mxArray *rhs[sizeof...(Args) + 1];
+        rhs[0] = handle;
+        for (size_t i=0; i<sizeof...(Args); i++) rhs[i+1] = in[i];
+        mxArray *out = nullptr;
+        mxArray *err = mexCallMATLABWithTrap(1, &out, sizeof...(Args) + 1, rhs, "feval");
+        for (size_t i=0; i<sizeof...(Args); i++) mxDestroyArray(in[i]);
+        if (err) {
+            mxArray *msg = mxGetProperty(err, 0, "message");
+            std::string text = msg ? from_mx<std::string>(msg) : "MATLAB callback failed";
+            if (msg) mxDestroyArray(msg);
+            mxDestroyArray(err);
+            throw std::runtime_error(text);
+        }
+        return out;
+    }
+
+    R evaluate(const std::tuple<std::decay_t<Args>...> &args) const {
+        mxArray *in[sizeof...(Args) + 1];
+        args_to_mx(args, in, std::index_sequence_for<Args...>());
+        mxArray *out = feval(in);
+        R res = from_mx<R>(out);
+        mxDestroyArray(out);
+        return res;
+    }
+
+    static bool stackable(const mxArray *m, const mxArray *first) {
+        return mxIsNumeric(m) && !mxIsComplex(m) && !mxIsSparse(m) && mxGetN(m) == 1
+            && mxGetNumberOfDimensions(m) == 2 && mxGetClassID(m) == mxGetClassID(first)
+            && mxGetM(m) == mxGetM(first);
+    }
+
+    // Evaluates requests in a single vectorised call, false if they cannot be stacked
+    bool evaluate_batch(std::vector<request> &batch) const {
+        size_t n = batch.size(), nargs = sizeof...(Args);
+        std::vector<mxArray*> args(n * (nargs + 1));
+        for (size_t j=0; j<n; j++)
+            args_to_mx(batch[j].args, &args[j*(nargs+1)], std::index_sequence_for<Args...>());
+        bool ok = true;
+        for (size_t i=0; i<nargs && ok; i++)
+            for (size_t j=0; j<n && ok; j++)
+                ok = stackable(args[j*(nargs+1)+i], args[i]);
+        mxArray *in[sizeof...(Args) + 1];
+        for (size_t i=0; i<nargs && ok; i++) {
+            const mxArray *first = args[i];
+            size_t col = mxGetM(first) * mxGetElementSize(first);
+            in[i] = mxCreateNumericMatrix(mxGetM(first), n, mxGetClassID(first), mxREAL);
+            for (size_t j=0; j<n; j++)
+                memcpy(static_cast<char*>(mxGetData(in[i])) + j*col, mxGetData(args[j*(nargs+1)+i]), col);
+        }
+        for (mxArray *a : args)
+            if (a) mxDestroyArray(a);
+        if (!ok) return false;
+        mxArray *out = feval(in);
+        if (!mxIsNumeric(out) || mxIsComplex(out) || mxGetN(out) != n
+                || mxGetNumberOfDimensions(out) != 2) {
+            mxDestroyArray(out);
+            throw std::runtime_error(stringer("vectorised callback should return ", n, " columns"));
+        }
+        size_t rows = mxGetM(out), col = rows * mxGetElementSize(out);
+        for (size_t j=0; j<n; j++) {
+            mxArray *part = mxCreateNumericMatrix(rows, 1, mxGetClassID(out), mxREAL);
+            memcpy(mxGetData(part), static_cast<const char*>(mxGetData(out)) + j*col, col);
+            try {
+                batch[j].result.set_value(from_mx<R>(part));
+            } catch (...) {
+                batch[j].result.set_exception(std::current_exception());
+            }
+            mxDestroyArray(part);
+        }
+        mxDestroyArray(out);
+        return true;
+    }
+
+    void run(std::vector<request> &batch) const {
+        if (batch.size() > 1) {
+            try {
+                if (evaluate_batch(batch)) return;
+            } catch (const std::exception &) {
+                // evaluate one by one to report errors to the calls that caused them
+            }
+        }
+        for (auto &r : batch) {
+            try {
+                r.result.set_value(evaluate(r.args));
+            } catch (...) {
+                r.result.set_exception(std::current_exception());
+            }
+        }
+    }
+public:
+    static constexpr bool can_mex_cast = true;
+
+    matlab_callback(const mxArray *m)
+        : handle(const_cast<mxArray*>(m)), owner(std::this_thread::get_id()),
+          q(std::make_shared<queue>())
+    {
+        if (!mxIsFunctionHandle(m))
+            throw std::invalid_argument("should be a function handle");
+    }
+
+    void set_batch(size_t n) {
+        max_batch = std::max<size_t>(n, 1);
+    }
+
+    // Queues a call, to be evaluated by serve() on the MATLAB thread
+    std::future<R> call(Args... args) const {
+        request r{std::tuple<std::decay_t<Args>...>(std::move(args)...), std::promise<R>()};
+        std::future<R> res = r.result.get_future();
+        {
+            std::lock_guard<std::mutex> lock(q->mutex);
+            q->pending.push_back(std::move(r));
+        }
+        q->cv.notify_one();
+        return res;
+    }
+
+    R operator()(Args... args) const {
+        if (std::this_thread::get_id() == owner)
+            return evaluate(std::tuple<std::decay_t<Args>...>(std::move(args)...));
+        return call(std::move(args)...).get();
+    }
+
+    // Evaluates queued calls on the MATLAB thread, returns the number of calls evaluated
+    size_t serve_pending() const {
+        if (std::this_thread::get_id() != owner)
+            throw std::logic_error("matlab_callback served outside of the MATLAB thread");
+        size_t served = 0;
+        for (;;) {
+            std::vector<request> batch;
+            {
+                std::lock_guard<std::mutex> lock(q->mutex);
+                while (!q->pending.empty() && batch.size() < max_batch) {
+                    batch.push_back(std::move(q->pending.front()));
+                    q->pending.pop_front();
+                }
+            }
+            if (batch.empty()) return served;
+            run(batch);
+            served += batch.size();
+        }
+    }
+
+    // Serves calls until done is ready, typically the future of the worker threads' job
+    template<typename Future>
+    void serve(const Future &done) const {
+        while (done.wait_for(std::chrono::seconds(0)) != std::future_status::ready) {
+            {
+                std::unique_lock<std::mutex> lock(q->mutex);
+                q->cv.wait_for(lock, std::chrono::milliseconds(1), [this] { return !q->pending.empty(); });
+            }
+            serve_pending();
+        }
+        serve_pending();
+    }
+};
+} // namespace mexbind0x
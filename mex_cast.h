@@ -15,6 +15,8 @@
 #include <cxxabi.h>
 #endif
 #include "func_types.h"
+#include "fixed_matrix.h"
+#include "array_binding.h"
 
 namespace mexbind0x {
 using matlab_string = std::basic_string<mxChar>;
@@ -71,8 +73,8 @@ template<> struct get_mex_classid<unsigned long> : get_int_classid<unsigned long
 template<> struct get_mex_classid<unsigned long long> : get_int_classid<unsigned long long> {};
 
 template<typename F>
-typename F::result_type mex_visit(F f, const mxArray* m) {
-    switch (mxGetClassID(m)) {
+typename F::result_type mex_visit_class(F f, mxClassID id, const mxArray* m) {
+    switch (id) {
         case mxINT8_CLASS:      return f.template run<int8_t>(m);
         case mxUINT8_CLASS:     return f.template run<uint8_t>(m);
         case mxINT16_CLASS:     return f.template run<int16_t>(m);
@@ -92,6 +94,11 @@ typename F::result_type mex_visit(F f, const mxArray* m) {
     };
 }
 
+template<typename F>
+typename F::result_type mex_visit(F f, const mxArray* m) {
+    return mex_visit_class(f, mxGetClassID(m), m);
+}
+
 template<typename F>
 struct mex_visit2_call {
     F f;
@@ -156,7 +163,7 @@ template<typename T> struct is_complex<std::complex<T>> : public std::true_type
 
 // from_mx flat complex collections
 template<typename T>
-struct from_mx_visitor<T,std::enable_if_t<get_mex_classid<typename T::value_type::value_type>::value != mxUNKNOWN_CLASS && is_complex<typename T::value_type>::value > > {
+struct from_mx_visitor<T,std::enable_if_t<get_mex_classid<typename T::value_type::value_type>::value != mxUNKNOWN_CLASS && is_complex<typename T::value_type>::value && !is_fixed_shape<T>::value > > {
     typedef typename std::decay<T>::type result_type;
     template<typename V>
         T run(const mxArray *m) {
@@ -179,7 +186,41 @@ struct from_mx_visitor<T,std::enable_if_t<get_mex_classid<typename T::value_type
         }
 };
 
-template<typename T> T cast_ptr(const mxArray* m, void *ptr, int offset = 0) {
+// Element converter resolved once per mxArray class.
+// get reads a single element, gather copies count elements taken every stride elements.
+template<typename T>
+struct mx_converter {
+    T (*get)(const void *data, size_t idx);
+    void (*gather)(const void *data, size_t first, size_t stride, size_t count, T *dst);
+};
+
+template<typename T>
+struct mx_converter_visitor {
+    typedef mx_converter<T> result_type;
+    template<typename V>
+        static T get(const void *data, size_t idx) {
+            return static_cast<T>(static_cast<const V*>(data)[idx]);
+        }
+    template<typename V>
+        static void gather(const void *data, size_t first, size_t stride, size_t count, T *dst) {
+            const V *src = static_cast<const V*>(data) + first;
+            if (stride == 1)
+                for (size_t i=0; i<count; i++) dst[i] = static_cast<T>(src[i]);
+            else
+                for (size_t i=0; i<count; i++) dst[i] = static_cast<T>(src[i*stride]);
+        }
+    template<typename V>
+        result_type run(const mxArray *) {
+            return {&get<V>, &gather<V>};
+        }
+};
+
+template<typename T>
+mx_converter<T> make_mx_converter(const mxArray *m) {
+    return mex_visit(mx_converter_visitor<T>(), m);
+}
+
+template<typename T> T cast_ptr(const mxArray* m, void *ptr, size_t offset = 0) {
     mxClassID id = mxGetClassID(m);
     switch (id) {
         case mxINT8_CLASS: return (T)*(offset + (int8_t*)ptr);
@@ -217,14 +258,35 @@ from_mx(const mxArray *arg)
     return T(cast_ptr<T>(arg, mxGetData(arg)), cast_ptr<T>(arg, mxGetImagData(arg)));
 }
 
+// Called for handles of T: created by to_mx(T*), used by from_mx<T*>, freed by
+// MXCommands::on_class "_free". mex_memory.h specializes it for accounted classes.
+template<typename T, typename = void>
+struct mx_handle_hooks {
+    static void created(T*) {}
+    static void used(T*) {}
+    static void freed(T*) {}
+};
+
+template<typename T>
+using mx_handle_hooks_of = mx_handle_hooks<std::remove_cv_t<std::remove_pointer_t<T>>>;
+
+// The pointer stored by to_mx(T*), without calling the hooks
+template<typename T>
+T *mx_handle_ptr(const mxArray *arg)
+{
+    if (!mxIsInt8(arg) || mxGetNumberOfElements(arg) != sizeof(T*))
+        throw std::invalid_argument("Pointer should have been passed");
+    return *(T**)mxGetData(arg);
+}
+
 // from_mx generic pointer
 template<typename T>
 typename std::enable_if<std::is_pointer<T>::value, T>::type
 from_mx(const mxArray *arg)
 {
-    if (!mxIsInt8(arg) || mxGetNumberOfElements(arg) != sizeof(T))
-        throw std::invalid_argument("Pointer should have been passed");
-    return *(T*)mxGetData(arg);
+    T p = mx_handle_ptr<std::remove_pointer_t<T>>(arg);
+    mx_handle_hooks_of<T>::used(const_cast<std::remove_cv_t<std::remove_pointer_t<T>>*>(p));
+    return p;
 }
 
 // from_mx classes that have can_mex_cast
@@ -235,14 +297,41 @@ from_mx(const mxArray* a) {
     return T(a);
 }
 
+template<typename T>
+void check_ndvector_extent(size_t have) {
+    const size_t want = std::tuple_size<T>::value;
+    if (have != want)
+        throw std::invalid_argument(stringer("expected ", want, " elements, got ", have));
+}
+
 template<typename T, typename U>
-std::enable_if_t<(vector_rank<T>::value == 1),T>
+std::enable_if_t<(vector_rank<T>::value == 1 && is_std_array<T>::value),T>
+make_ndvector(NDArrayView<U,1> v) {
+    check_ndvector_extent<T>(v.max(0));
+    T res;
+    for (size_t i=0; i<res.size(); i++)
+        res[i] = static_cast<typename T::value_type>(v[i]);
+    return res;
+}
+
+template<typename T, typename U>
+std::enable_if_t<(vector_rank<T>::value > 1 && is_std_array<T>::value),T>
+make_ndvector(NDArrayView<U,vector_rank<T>::value> v) {
+    check_ndvector_extent<T>(v.max(0));
+    T res;
+    for (size_t i=0; i<res.size(); i++)
+        res[i] = make_ndvector<typename T::value_type>(v[i]);
+    return res;
+}
+
+template<typename T, typename U>
+std::enable_if_t<(vector_rank<T>::value == 1 && !is_std_array<T>::value),T>
 make_ndvector(NDArrayView<U,vector_rank<T>::value> v) {
     return T(v.begin(), v.end());
 }
 
 template<typename T, typename U>
-std::enable_if_t<(vector_rank<T>::value > 1),T>
+std::enable_if_t<(vector_rank<T>::value > 1 && !is_std_array<T>::value),T>
 make_ndvector(NDArrayView<U,vector_rank<T>::value> v) {
     T res(v.max(0));
     for (size_t i=0; i<res.size(); i++)
@@ -263,8 +352,12 @@ struct from_mx_visitor<T, std::enable_if_t<(vector_rank<T>::value > 1 && is_flat
 // from_mx std::string
 template<typename T, typename = std::enable_if_t<std::is_same<T,std::string>::value> >
 static inline T from_mx(const mxArray *arg) {
-    if (mxIsChar(arg))
-        return {mxArrayToUTF8String(arg)};
+    if (mxIsChar(arg)) {
+        char *s = mxArrayToUTF8String(arg);
+        std::string res(s);
+        mxFree(s);
+        return res;
+    }
     mexErrMsgIdAndTxt("mexbind0x:expected_string", "Expected string, got %s\n",
                       mxGetClassName(arg));
     throw std::runtime_error("unreachable");
@@ -293,6 +386,7 @@ template<typename T>
 mxArray *to_mx(T* arg) {
     mxArray *res = mxCreateNumericMatrix(sizeof(arg), 1, mxINT8_CLASS, mxREAL);
     *(T**)mxGetData(res) = arg;
+    mx_handle_hooks_of<T*>::created(const_cast<std::remove_cv_t<T>*>(arg));
     return res;
 }
 
@@ -303,8 +397,16 @@ enable_if_prim<T,mxArray *> to_mx(T arg) {
     return res;
 }
 
+static inline mxArray *to_mx(double arg) {
+    return mxCreateDoubleScalar(arg);
+}
+
+static inline mxArray *to_mx(bool arg) {
+    return mxCreateLogicalScalar(arg);
+}
+
 template<typename T>
-enable_if_prim<typename T::value_type,mxArray *> to_mx(const T& arg) {
+enable_if_prim<typename T::value_type,std::enable_if_t<!is_fixed_shape<T>::value && !mx_binding_reads<T>::value,mxArray *>> to_mx(const T& arg) {
     typedef typename T::value_type V;
     mxArray *res = mxCreateNumericMatrix(arg.size(), 1, get_mex_classid<V>::value, mxREAL);
     V* ptr = (V*)mxGetData(res);
@@ -316,58 +418,316 @@ template<typename C>
 size_t matlab_index(const C& dim, const C& idx)
 {
     size_t res = idx[idx.size()-1];
-    for (int i=(int)idx.size()-2; i>=0; i--)
+    for (size_t i=idx.size()-1; i-- > 0;)
         res = res * dim[i] + idx[i];
     return res;
 }
 
-template<typename T, size_t N, typename = enable_if_prim<T> >
-void assign_ndvector(T val, std::array<mwIndex,N> &iterator, mwSize idx, mxArray *m, const std::array<mwIndex,N> &dim) {
+template<typename T> struct remove_complex : type_t<T> {};
+template<typename T> struct remove_complex<std::complex<T>> : type_t<T> {};
+
+// Output policy of to_mx_as: x(:) as a column or x(:).' as a row instead of the natural shape
+enum class mx_shape { keep, column, row };
+
+// Array being written by to_mx_as<V>: elements are converted to V as they are stored,
+// std::complex<R> makes a complex array of class R
+template<typename V>
+class mx_output {
+    using R = typename remove_complex<V>::type;
+    mxArray *res;
+    R *real;
+    R *imag;
+public:
+    template<typename D>
+    mx_output(const D &dims, mx_shape shape = mx_shape::keep) {
+        mxComplexity c = is_complex<V>::value ? mxCOMPLEX : mxREAL;
+        if (shape == mx_shape::keep) {
+            res = mxCreateNumericArray(dims.size(), dims.data(), get_mex_classid<R>::value, c);
+        } else {
+            size_t n = 1;
+            for (auto d : dims) n *= d;
+            mwSize flat[2] = {n, 1};
+            if (shape == mx_shape::row) std::swap(flat[0], flat[1]);
+            res = mxCreateNumericArray(2, flat, get_mex_classid<R>::value, c);
+        }
+        real = static_cast<R*>(mxGetData(res));
+        imag = is_complex<V>::value ? static_cast<R*>(mxGetImagData(res)) : nullptr;
+    }
+
+    template<typename S>
+    std::enable_if_t<!is_complex<S>::value> put(size_t i, const S &s) {
+        real[i] = static_cast<R>(s);
+    }
+
+    template<typename S>
+    std::enable_if_t<is_complex<S>::value> put(size_t i, const S &s) {
+        static_assert(is_complex<V>::value, "complex values need a complex output type");
+        real[i] = static_cast<R>(std::real(s));
+        imag[i] = static_cast<R>(std::imag(s));
+    }
+
+    mxArray *get() const {
+        return res;
+    }
+};
+
+template<typename T, size_t N, typename Out, typename = enable_if_prim<T> >
+void assign_ndvector(T val, std::array<mwIndex,N> &iterator, mwSize idx, Out &out, const std::array<mwIndex,N> &dim) {
+    (void)idx; // Silence warning when NDEBUG is set
     assert(idx == iterator.size());
-    T *data = (T*)mxGetData(m);
-    size_t i = matlab_index(dim, iterator);
-    data[i] = val;
+    out.put(matlab_index(dim, iterator), val);
 }
 
-template<typename T, size_t sz, size_t N>
-void assign_ndvector(const T (&vec)[sz], std::array<mwIndex,N> &iterator, mwSize idx, mxArray *m, const std::array<mwIndex,N> &dim) {
+template<typename T, size_t sz, size_t N, typename Out>
+void assign_ndvector(const T (&vec)[sz], std::array<mwIndex,N> &iterator, mwSize idx, Out &out, const std::array<mwIndex,N> &dim) {
     for (size_t i=0; i<sz; i++) {
         iterator[idx] = i;
-        assign_ndvector(static_cast<const T&>(vec[i]), iterator, idx+1, m, dim);
+        assign_ndvector(static_cast<const T&>(vec[i]), iterator, idx+1, out, dim);
     }
 }
 
-template<typename T, size_t N, typename = enable_if_prim<T> >
-void assign_ndvector(std::complex<T> val, std::array<mwIndex,N> &iterator, mwSize idx, mxArray *m, const std::array<mwIndex,N> &dim) {
+template<typename T, size_t N, typename Out, typename = enable_if_prim<T> >
+void assign_ndvector(std::complex<T> val, std::array<mwIndex,N> &iterator, mwSize idx, Out &out, const std::array<mwIndex,N> &dim) {
     (void)idx; // Silence warning when NDEBUG is set
     assert(idx == iterator.size());
-    T *data = (T*)mxGetData(m);
-    T *imag_data = (T*)mxGetImagData(m);
-    size_t i = matlab_index(dim, iterator);
-    data[i] = std::real(val);
-    imag_data[i] = std::imag(val);
+    out.put(matlab_index(dim, iterator), val);
 }
 
-template<typename T, size_t N, typename = std::enable_if_t<has_size_v<T>> >
-void assign_ndvector(const T &vec, std::array<mwIndex,N> &iterator, mwSize idx, mxArray *m, const std::array<mwIndex,N> &dim) {
+template<typename T, size_t N, typename Out, typename = std::enable_if_t<has_size_v<T>> >
+void assign_ndvector(const T &vec, std::array<mwIndex,N> &iterator, mwSize idx, Out &out, const std::array<mwIndex,N> &dim) {
     for (size_t i=0; i<vec.size(); i++) {
         iterator[idx] = i;
-        assign_ndvector(static_cast<const typename T::value_type&>(vec[i]), iterator, idx+1, m, dim);
+        assign_ndvector(static_cast<const typename T::value_type&>(vec[i]), iterator, idx+1, out, dim);
     }
 }
 
-template<typename T> struct remove_complex : type_t<T> {};
-template<typename T> struct remove_complex<std::complex<T>> : type_t<T> {};
 
+class CellSaver;
+template<typename T, typename = void>
+struct has_save_load : std::false_type {};
 template<typename T>
-mxArray *to_mx(const std::vector<T>& arg)
+struct has_save_load<T, decltype((void)save_load(std::declval<CellSaver&>(), std::declval<T&>()))>
+    : std::true_type {};
+
+// Nested vectors as an N-D array of V
+template<typename V, typename T>
+std::enable_if_t<!has_save_load<T>::value, mxArray *> to_mx_as(const std::vector<T>& arg, mx_shape shape = mx_shape::keep)
 {
     auto sz = ndvector_size<mwIndex>(arg);
-    using value_type = typename ndvector_value_type<T>::type;
-    mxComplexity c = is_complex<value_type>::value?mxCOMPLEX:mxREAL;
-    mxArray *res = mxCreateNumericArray(sz.size(), sz.data(), get_mex_classid<typename remove_complex<value_type>::type>::value, c);
+    mx_output<V> out(sz, shape);
     std::array<mwIndex, sz.size()> iterator;
-    assign_ndvector(arg, iterator, 0, res, sz);
+    assign_ndvector(arg, iterator, 0, out, sz);
+    return out.get();
+}
+
+// Vectors of save_load types are stored by columns, see ColumnSaver
+template<typename T>
+std::enable_if_t<!has_save_load<T>::value, mxArray *> to_mx(const std::vector<T>& arg)
+{
+    return to_mx_as<typename ndvector_value_type<T>::type>(arg);
+}
+
+// fixed-shape types: std::array (nested) and fixed_matrix.
+// Shape is checked against mxGetDimensions and elements are copied by an unrolled sequence.
+template<typename E, typename V>
+std::enable_if_t<!is_complex<E>::value,E> fixed_element(const V *real, const V *, size_t k) {
+    return static_cast<E>(real[k]);
+}
+
+template<typename E, typename V>
+std::enable_if_t<is_complex<E>::value,E> fixed_element(const V *real, const V *imag, size_t k) {
+    using R = typename E::value_type;
+    return E(static_cast<R>(real[k]), imag ? static_cast<R>(imag[k]) : R());
+}
+
+template<typename E, typename V>
+std::enable_if_t<!is_complex<E>::value> store_fixed_element(const E &e, V *real, V *, size_t k) {
+    real[k] = e;
+}
+
+template<typename E, typename V>
+std::enable_if_t<is_complex<E>::value> store_fixed_element(const E &e, V *real, V *imag, size_t k) {
+    real[k] = std::real(e);
+    imag[k] = std::imag(e);
+}
+
+template<typename T, typename V, size_t ... K>
+void load_fixed(T &res, const V *real, const V *imag, std::index_sequence<K...>) {
+    using L = fixed_layout<T>;
+    using E = typename L::element_type;
+    using List = int[];
+    (void)List{0, ((void)(L::template at<K>(res) = fixed_element<E>(real, imag, K)), 0)...};
+}
+
+template<typename T, typename V, size_t ... K>
+void store_fixed(const T &arg, V *real, V *imag, std::index_sequence<K...>) {
+    using L = fixed_layout<T>;
+    using List = int[];
+    (void)List{0, ((void)store_fixed_element(L::template at<K>(arg), real, imag, K), 0)...};
+    (void)imag;
+}
+
+template<typename T>
+void check_fixed_shape(const mxArray *m) {
+    using L = fixed_layout<T>;
+    const size_t size = L::size;
+    size_t nd = mxGetNumberOfDimensions(m);
+    const mwSize *dim = mxGetDimensions(m);
+    if (L::rank == 1) {
+        if (nd != 2 || (dim[0] != 1 && dim[1] != 1) || dim[0]*dim[1] != size)
+            throw std::invalid_argument(stringer("expected a vector of ", size, " elements"));
+        return;
+    }
+    size_t n = nd > L::rank ? nd : L::rank;
+    for (size_t i=0; i<n; i++) {
+        size_t have = i < nd ? dim[i] : 1;
+        if (have != L::dim(i))
+            throw std::invalid_argument(stringer("dimension #", i, " should be ", L::dim(i), ", got ", have));
+    }
+}
+
+template<typename T>
+struct from_mx_visitor<T, std::enable_if_t<is_fixed_shape<T>::value>> {
+    typedef T result_type;
+    template<typename V>
+        T run(const mxArray *m) {
+            using L = fixed_layout<T>;
+            if (mxIsComplex(m) && !is_complex<typename L::element_type>::value)
+                throw std::invalid_argument("should be real");
+            check_fixed_shape<T>(m);
+            T res;
+            load_fixed(res, static_cast<const V*>(mxGetData(m)),
+                       static_cast<const V*>(mxGetImagData(m)),
+                       std::make_index_sequence<L::size>());
+            return res;
+        }
+};
+
+template<typename T, size_t ... I>
+std::array<mwSize, sizeof...(I)> fixed_dims(std::index_sequence<I...>) {
+    return {{fixed_layout<T>::dim(I)...}};
+}
+
+template<typename T>
+std::enable_if_t<is_fixed_shape<T>::value, mxArray *> to_mx(const T& arg) {
+    using L = fixed_layout<T>;
+    using E = typename L::element_type;
+    using V = typename remove_complex<E>::type;
+    auto dims = fixed_dims<T>(std::make_index_sequence<(L::rank < 2 ? 2 : L::rank)>());
+    mxArray *res = mxCreateNumericArray(dims.size(), dims.data(), get_mex_classid<V>::value,
+                                        is_complex<E>::value ? mxCOMPLEX : mxREAL);
+    store_fixed(arg, static_cast<V*>(mxGetData(res)), static_cast<V*>(mxGetImagData(res)),
+                std::make_index_sequence<L::size>());
+    return res;
+}
+
+// types with mx_array_binding, see array_binding.h
+template<typename T>
+std::enable_if_t<mx_binding_wraps<T>::value, T> from_mx(const mxArray *m) {
+    using B = mx_array_binding<T>;
+    using E = std::remove_const_t<typename B::element_type>;
+    constexpr size_t N = B::rank;
+    static_assert(N > 0, "mx_array_binding rank should be positive");
+    if (mxGetClassID(m) != get_mex_classid<E>::value)
+        throw std::invalid_argument(stringer("expected ", get_type_name<E>(), " array, got ",
+                                             mxGetClassName(m)));
+    if (mxIsComplex(m)) throw std::invalid_argument("should be real");
+    size_t nd = mxGetNumberOfDimensions(m);
+    const mwSize *dim = mxGetDimensions(m);
+    std::array<size_t, N> shape;
+    std::array<ptrdiff_t, N> strides;
+    if (N == 1) {
+        if (nd > 2 || (dim[0] != 1 && dim[1] != 1))
+            throw std::invalid_argument("one-dimensional array expected");
+        shape[0] = mxGetNumberOfElements(m);
+        strides[0] = 1;
+    } else {
+        for (size_t i=N; i<nd; i++)
+            if (dim[i] != 1)
+                throw std::invalid_argument(stringer("expected at most ", N, " dimensions"));
+        ptrdiff_t mult = 1;
+        for (size_t i=0; i<N; i++) {
+            shape[i] = i < nd ? dim[i] : 1;
+            strides[i] = mult;
+            mult *= shape[i];
+        }
+    }
+    return B::wrap(static_cast<E*>(mxGetData(m)), shape.data(), strides.data());
+}
+
+template<typename T, size_t N, size_t M>
+bool binding_layout(const T &arg, std::array<mwSize,M> &dims, std::array<ptrdiff_t,N> &strides) {
+    using B = mx_array_binding<T>;
+    bool contiguous = true;
+    ptrdiff_t expected = 1;
+    dims.fill(1);
+    for (size_t i=0; i<N; i++) {
+        dims[i] = B::shape(arg, i);
+        strides[i] = B::stride(arg, i);
+        if (dims[i] > 1 && strides[i] != expected) contiguous = false;
+        expected *= dims[i];
+    }
+    return contiguous;
+}
+
+// Calls put(k, e) for the elements e of a strided array in column-major order k
+template<typename Put, typename E, size_t N, size_t M>
+void strided_store(Put &&put, const E *src, const std::array<mwSize,M> &dims,
+                   const std::array<ptrdiff_t,N> &strides) {
+    size_t total = 1;
+    for (auto d : dims) total *= d;
+    if (total == 0) return;
+    std::array<size_t,N> idx{};
+    ptrdiff_t offset = 0;
+    for (size_t k=0; k<total; k+=dims[0]) {
+        for (size_t i=0; i<dims[0]; i++)
+            put(k+i, src[offset + (ptrdiff_t)i*strides[0]]);
+        for (size_t d=1; d<N; d++) {
+            offset += strides[d];
+            if (++idx[d] < dims[d]) break;
+            offset -= strides[d] * (ptrdiff_t)dims[d];
+            idx[d] = 0;
+        }
+    }
+}
+
+template<typename E, size_t N, size_t M>
+void strided_copy(E *dst, const E *src, const std::array<mwSize,M> &dims,
+                  const std::array<ptrdiff_t,N> &strides) {
+    strided_store([dst](size_t k, const E &e) { dst[k] = e; }, src, dims, strides);
+}
+
+template<typename T>
+std::enable_if_t<mx_binding_reads<T>::value, mxArray *> to_mx(const T& arg) {
+    using B = mx_array_binding<T>;
+    using E = std::remove_const_t<typename B::element_type>;
+    constexpr size_t N = B::rank;
+    std::array<mwSize, (N < 2 ? 2 : N)> dims;
+    std::array<ptrdiff_t, N> strides;
+    bool contiguous = binding_layout(arg, dims, strides);
+    mxArray *res = mxCreateNumericArray(dims.size(), dims.data(), get_mex_classid<E>::value, mxREAL);
+    E *dst = static_cast<E*>(mxGetData(res));
+    size_t total = mxGetNumberOfElements(res);
+    if (contiguous) {
+        if (total) memcpy(dst, B::data(arg), total*sizeof(E));
+    } else strided_copy(dst, B::data(arg), dims, strides);
+    return res;
+}
+
+template<typename T>
+std::enable_if_t<mx_binding_releases<T>::value && !std::is_lvalue_reference<T>::value, mxArray *>
+to_mx(T&& arg) {
+    using B = mx_array_binding<T>;
+    using E = std::remove_const_t<typename B::element_type>;
+    constexpr size_t N = B::rank;
+    std::array<mwSize, (N < 2 ? 2 : N)> dims;
+    std::array<ptrdiff_t, N> strides;
+    if (!binding_layout(arg, dims, strides))
+        return to_mx(static_cast<const T&>(arg));
+    mxArray *res = mxCreateNumericMatrix(0, 0, get_mex_classid<E>::value, mxREAL);
+    mxFree(mxGetData(res)); // null in MATLAB, but not every runtime leaves empty arrays unallocated
+    mxSetData(res, B::release(std::move(arg)));
+    mxSetDimensions(res, dims.data(), dims.size());
     return res;
 }
 
@@ -375,12 +735,55 @@ static inline mxArray *to_mx(mx_array_t m) {
     return const_cast<mxArray *>(m.m); // MATLAB makes it impossible pass argument from input to output
 }
 
+static inline mxArray *to_mx(const std::string &s) {
+    return mxCreateString(s.c_str());
+}
+
+// to_mx_as<V>(arg, shape) returns what to_mx(arg) would with elements of V
+// (std::complex<R> for a complex array), converted while the array is written.
+// Flat containers:
 template<typename V, typename T>
-mxArray *to_mx_as(const T& arg) {
-    mxArray *res = mxCreateNumericMatrix(arg.size(), 1, get_mex_classid<V>::value, mxREAL);
-    V* ptr = (V*)mxGetData(res);
-    for (auto r : arg) *ptr++ = r;
-    return res;
+enable_if_prim<typename T::value_type, std::enable_if_t<!fixed_layout<T>::value && !mx_binding_reads<T>::value, mxArray *>>
+to_mx_as(const T& arg, mx_shape shape = mx_shape::keep) {
+    std::array<mwSize,2> dims{{arg.size(), 1}};
+    mx_output<V> out(dims, shape);
+    size_t i = 0;
+    for (auto r : arg) out.put(i++, r);
+    return out.get();
+}
+
+// Scalars and fixed shapes:
+template<typename V, typename T, size_t ... K>
+void store_fixed_as(const T &arg, mx_output<V> &out, std::index_sequence<K...>) {
+    using L = fixed_layout<T>;
+    using List = int[];
+    (void)List{0, ((void)out.put(K, L::template at<K>(arg)), 0)...};
+}
+
+template<typename V, typename T>
+std::enable_if_t<fixed_layout<T>::value, mxArray *> to_mx_as(const T& arg, mx_shape shape = mx_shape::keep) {
+    using L = fixed_layout<T>;
+    mx_output<V> out(fixed_dims<T>(std::make_index_sequence<(L::rank < 2 ? 2 : L::rank)>()), shape);
+    store_fixed_as(arg, out, std::make_index_sequence<L::size>());
+    return out.get();
+}
+
+// Types with mx_array_binding, e.g. NDArrayView, read through their strides:
+template<typename V, typename T>
+std::enable_if_t<mx_binding_reads<T>::value, mxArray *> to_mx_as(const T& arg, mx_shape shape = mx_shape::keep) {
+    using B = mx_array_binding<T>;
+    using E = std::remove_const_t<typename B::element_type>;
+    constexpr size_t N = B::rank;
+    std::array<mwSize, (N < 2 ? 2 : N)> dims;
+    std::array<ptrdiff_t, N> strides;
+    bool contiguous = binding_layout(arg, dims, strides);
+    mx_output<V> out(dims, shape);
+    const E *src = B::data(arg);
+    if (contiguous) {
+        size_t total = mxGetNumberOfElements(out.get());
+        for (size_t k=0; k<total; k++) out.put(k, src[k]);
+    } else strided_store([&out](size_t k, const E &e) { out.put(k, e); }, src, dims, strides);
+    return out.get();
 }
 
 template<typename T> struct mx_store_by_move : std::false_type {};
@@ -405,25 +808,31 @@ from_mx(const mxArray *arg)
 }
 
 template<typename T>
-std::enable_if_t<!is_complex<T>::value,T> cast_ptr_complex(const mxArray * m, int idx) {
+std::enable_if_t<!is_complex<T>::value,T> cast_ptr_complex(const mxArray * m, size_t idx) {
     return cast_ptr<T>(m, mxGetData(m), idx);
 }
 
 template<typename T>
-std::enable_if_t<is_complex<T>::value> cast_ptr_complex(const mxArray * m, int idx) {
+std::enable_if_t<is_complex<T>::value> cast_ptr_complex(const mxArray * m, size_t idx) {
     return T(
             cast_ptr<T>(m, mxGetData(m), idx),
             cast_ptr<T>(m, mxGetImagData(m), idx)
             );
 }
 
-class CellSaver;
 template<typename T, typename = decltype(save_load(std::declval<CellSaver&>(), std::declval<T&>()))>
 mxArray* to_mx(const T& t);
 class CellLoader;
 template<typename T, typename = decltype(save_load(std::declval<CellLoader&>(), std::declval<T&>()))>
 std::decay_t<T> from_mx(const mxArray *m);
 
+template<typename T> struct is_record_vector : std::false_type {};
+template<typename E, typename A> struct is_record_vector<std::vector<E,A>> : has_save_load<E> {};
+template<typename T>
+std::enable_if_t<has_save_load<T>::value, mxArray *> to_mx(const std::vector<T>& v);
+template<typename T>
+std::enable_if_t<is_record_vector<T>::value, T> from_mx(const mxArray *m);
+
 class CellSaver {
     std::vector<mx_array_t> cells;
 public:
@@ -449,7 +858,7 @@ public:
 
 class CellLoader {
     const mxArray *m;
-    int idx = 0;
+    size_t idx = 0;
 public:
     CellLoader(const mxArray *m) : m(m) {}
     template<typename T>
@@ -465,6 +874,172 @@ public:
         }
 };
 
+// Archive writing a vector of records as a 1x1 struct of columns f1, f2, ..., one per saved
+// member. Members with a MATLAB class (arithmetic, float16) fill one numeric column,
+// others a cell column. The first record fixes the number and types of the members.
+class ColumnSaver {
+    struct column {
+        virtual ~column() = default;
+        virtual mxArray *finish() = 0;
+    };
+
+    template<typename F, typename = void>
+    struct typed_column : column {
+        mxArray *cells;
+        explicit typed_column(size_t rows) : cells(mxCreateCellMatrix(rows, 1)) {}
+        ~typed_column() { if (cells) mxDestroyArray(cells); }
+        void set(size_t row, const F &f) { mxSetCell(cells, row, to_mx(f)); }
+        mxArray *finish() override { mxArray *res = cells; cells = nullptr; return res; }
+    };
+
+    template<typename F>
+    struct typed_column<F, enable_if_prim<F>> : column {
+        mxArray *array;
+        F *data;
+        explicit typed_column(size_t rows)
+            : array(mxCreateNumericMatrix(rows, 1, get_mex_classid<F>::value, mxREAL)),
+              data(static_cast<F*>(mxGetData(array))) {}
+        ~typed_column() { if (array) mxDestroyArray(array); }
+        void set(size_t row, const F &f) { data[row] = f; }
+        mxArray *finish() override { mxArray *res = array; array = nullptr; return res; }
+    };
+
+    size_t rows;
+    size_t row = 0;
+    size_t field = 0;
+    std::vector<std::unique_ptr<column>> columns;
+    std::vector<const std::type_info*> types;
+public:
+    explicit ColumnSaver(size_t rows) : rows(rows) {}
+
+    template<typename F>
+    ColumnSaver& operator&(const F &f) {
+        if (field == columns.size()) {
+            if (row > 0)
+                throw std::invalid_argument(stringer("record ", row+1, " has more members than the first"));
+            columns.emplace_back(new typed_column<F>(rows));
+            types.push_back(&typeid(F));
+        } else if (*types[field] != typeid(F)) {
+            throw std::invalid_argument(stringer("member ", field+1, " of record ", row+1, " changed type"));
+        }
+        static_cast<typed_column<F>*>(columns[field].get())->set(row, f);
+        field++;
+        return *this;
+    }
+
+    template<typename F>
+    ColumnSaver& operator<<(const F &f) {
+        return *this & f;
+    }
+
+    void next_record() {
+        if (row > 0 && field != columns.size())
+            throw std::invalid_argument(stringer("record ", row+1, " has fewer members than the first"));
+        row++;
+        field = 0;
+    }
+
+    mxArray *finish() {
+        std::vector<std::string> names;
+        for (size_t i=0; i<columns.size(); i++)
+            names.push_back(stringer('f', i+1));
+        std::vector<const char*> fields;
+        for (auto &n : names)
+            fields.push_back(n.c_str());
+        mxArray *res = mxCreateStructMatrix(1, 1, fields.size(), fields.data());
+        for (size_t i=0; i<columns.size(); i++)
+            mxSetFieldByNumber(res, 0, i, columns[i]->finish());
+        return res;
+    }
+};
+
+// Reads the struct of columns written by ColumnSaver, members in field order
+class ColumnLoader {
+    std::vector<const mxArray*> columns;
+    size_t rows = 0;
+    size_t row = 0;
+    size_t field = 0;
+
+    const mxArray *next_column() {
+        if (field >= columns.size())
+            throw std::out_of_range(stringer("ColumnLoader: record has more than ", columns.size(), " members"));
+        return columns[field++];
+    }
+
+    // The int overload is preferred for types with a MATLAB class
+    template<typename F>
+    enable_if_prim<F> load(const mxArray *c, F &f, int) const {
+        if (mxGetClassID(c) == get_mex_classid<F>::value)
+            f = static_cast<const F*>(mxGetData(c))[row];
+        else
+            f = cast_ptr<F>(c, mxGetData(c), row);
+    }
+
+    template<typename F>
+    void load(const mxArray *c, F &f, long) const {
+        if (!mxIsCell(c))
+            throw std::invalid_argument(stringer("member ", field, " should be a cell column"));
+        f = from_mx<F>(mxGetCell(c, row));
+    }
+public:
+    explicit ColumnLoader(const mxArray *m) {
+        if (!mxIsStruct(m) || mxGetNumberOfElements(m) != 1)
+            throw std::invalid_argument("expected a struct of columns");
+        int n = mxGetNumberOfFields(m);
+        for (int i=0; i<n; i++) {
+            const mxArray *c = mxGetFieldByNumber(m, 0, i);
+            if (!c || mxIsComplex(c) || mxIsSparse(c) || (!mxIsCell(c) && !mxIsNumeric(c) && !mxIsLogical(c)))
+                throw std::invalid_argument(stringer("field ", i+1, " should be a real column or a cell"));
+            size_t len = mxGetNumberOfElements(c);
+            if (i > 0 && len != rows)
+                throw std::invalid_argument(stringer("field ", i+1, " has ", len, " rows, expected ", rows));
+            rows = len;
+            columns.push_back(c);
+        }
+    }
+
+    size_t size() const {
+        return rows;
+    }
+
+    template<typename F>
+    ColumnLoader& operator&(F &f) {
+        load(next_column(), f, 0);
+        return *this;
+    }
+
+    template<typename F>
+    ColumnLoader& operator>>(F &f) {
+        return *this & f;
+    }
+
+    void next_record() {
+        row++;
+        field = 0;
+    }
+};
+
+template<typename T>
+std::enable_if_t<has_save_load<T>::value, mxArray *> to_mx(const std::vector<T>& v) {
+    ColumnSaver s(v.size());
+    for (auto &t : v) {
+        save_load(s, const_cast<T&>(t));
+        s.next_record();
+    }
+    return s.finish();
+}
+
+template<typename T>
+std::enable_if_t<is_record_vector<T>::value, T> from_mx(const mxArray *m) {
+    ColumnLoader l(m);
+    T res(l.size());
+    for (auto &t : res) {
+        save_load(l, t);
+        l.next_record();
+    }
+    return res;
+}
+
 template<typename T, typename>
 mxArray* to_mx(const T& t) {
     CellSaver c;
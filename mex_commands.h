@@ -1,8 +1,20 @@
 #pragma once
 #include "mex_params.h"
 #include "profiler.h"
+#include "mex_cache.h"
+#include "mex_lifecycle.h"
+#include "mex_arena.h"
+#include "mex_memory.h"
+#include "mx_buffer.h"
+#include "mx_ring.h"
+#include <cctype>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <limits>
 #include <stdexcept>
 #include <string>
+#include <utility>
 #include <vector>
 
 namespace mexbind0x {
@@ -19,6 +31,15 @@ auto wrap_varargout(F&& f, int nargout, types_t<int,Args...>)
     };
 }
 
+// Reads a size argument of a command: a whole number from 0 to `max`, `what` names it in errors
+inline size_t size_from_mx(const mxArray *m, const char *what,
+                           double max = static_cast<double>(std::numeric_limits<size_t>::max() >> 1)) {
+    double v = from_mx<double>(m);
+    if (!(v >= 0 && v <= max) || v != std::floor(v))
+        throw std::invalid_argument(stringer(what, " should be a whole number from 0 to ", max));
+    return static_cast<size_t>(v);
+}
+
 class mx_auto {
 private:
     mxArray * val;
@@ -29,9 +50,10 @@ public:
     mx_auto(mxArray *val) : val(val) {}
     mx_auto(mx_array_t val) : val(val) {}
 
+    // The result of to_mx_as<T>, e.g. mx_auto::as<double>(ints, mx_shape::row)
     template<typename T, typename U>
-    static mx_auto as(U&& val) {
-        return mx_auto(to_mx_as<T>(std::forward<U>(val)));
+    static mx_auto as(U&& val, mx_shape shape = mx_shape::keep) {
+        return mx_auto(to_mx_as<T>(std::forward<U>(val), shape));
     }
 
     template <typename T> operator T() const { return from_mx<T>(val); }
@@ -56,7 +78,7 @@ public:
         return val;
     }
 
-    mx_auto operator[](int idx) {
+    mx_auto operator[](size_t idx) {
         return mxGetCell(val, idx);
     }
 
@@ -73,57 +95,196 @@ mx_auto from_mx(mxArray const* m, type_t<mx_auto>)
     return {const_cast<mxArray*>(m)};
 }
 
+// Returning mx_auto (e.g. mx_auto::as<T>(...)) from a command passes the array through
+inline mxArray *to_mx(const mx_auto &a)
+{
+    return const_cast<mxArray*>(static_cast<const mxArray*>(a));
+}
+
+// Compares a MATLAB char array to s without converting it.
+// Only ASCII is compared directly, other strings are converted first.
+inline bool mx_string_equals(const mxArray *m, const char *s, bool prefix = false) {
+    const mxChar *c = mxGetChars(m);
+    size_t n = mxGetNumberOfElements(m), i = 0;
+    for (; s[i]; i++) {
+        if (static_cast<unsigned char>(s[i]) >= 0x80) {
+            char *str = mxArrayToString(m);
+            bool res = prefix ? strncmp(str, s, strlen(s)) == 0 : strcmp(str, s) == 0;
+            mxFree(str);
+            return res;
+        }
+        if (i == n || c[i] != static_cast<mxChar>(s[i]))
+            return false;
+    }
+    return prefix || i == n;
+}
+
 // MXCommands allows you to dispatch a function based on argin[0]
+struct on_init_tag;
+struct on_exit_tag;
+
 class MXCommands {
     unsigned nargout;
     mxArray **argout;
     unsigned nargin;
     const mxArray **argin;
-    std::string command;
+    const mxArray *command_array;
+    std::string command; // converted on first use by get_command
     bool matched = false;
-    std::string classname_read;
     Profiler _a;
+    arena_scope _scope;
+
+    bool is_command(const char *command_) const {
+        return mx_string_equals(command_array, command_);
+    }
     public:
         MXCommands(int nargout, mxArray *argout[], int nargin, const mxArray *argin[])
             : nargout(nargout), argout(argout), nargin(nargin-1), argin(argin+1)
         {
             if (nargin < 1 || !mxIsChar(argin[0]))
                 mexErrMsgIdAndTxt("code:command_required", "First argument should be a command");
-            char *command_s = mxArrayToString(argin[0]);
-            command = command_s;
-            mxFree(command_s);
+            command_array = argin[0];
+        }
+
+        // Runs f() on the first call that reaches it, once per loaded module; commands matched
+        // after it see the initialized state. If f throws, the next call retries.
+        // Also answers "_warmup", which does nothing but trigger the initialization.
+        template<typename F>
+        MXCommands& on_init(F&& f) {
+            bool &done = module_flag<std::pair<on_init_tag, std::decay_t<F>>>();
+            if (!done) {
+                trace_span span("command", "_init");
+                f();
+                done = true;
+                at_mex_exit([&done] { done = false; });
+            }
+            if (!matched && is_command("_warmup"))
+                matched = true;
+            return *this;
+        }
+
+        // Registers f() once to run when the MEX file is cleared (mexAtExit),
+        // after the handlers registered later
+        template<typename F>
+        MXCommands& on_exit(F&& f) {
+            bool &registered = module_flag<std::pair<on_exit_tag, std::decay_t<F>>>();
+            if (!registered) {
+                registered = true;
+                at_mex_exit([&registered, f] { registered = false; f(); });
+            }
+            return *this;
+        }
+
+        // mexLock the module so that "clear functions" keeps the initialized state;
+        // "_unlock" releases it until the next call
+        MXCommands& keep_loaded() {
+            if (!matched && is_command("_unlock")) {
+                matched = true;
+                if (mexIsLocked()) mexUnlock();
+            } else if (!mexIsLocked()) {
+                mexLock();
+            }
+            return *this;
         }
 
         template<typename T>
         MXCommands& on_class(const char *classname) {
-            if (nargin > 1 && mxIsChar(argin[0]) && classname_read.size() == 0) {
-                char *arg1_s = mxArrayToString(argin[0]);
-                classname_read = arg1_s;
-                mxFree(arg1_s);
-            }
-            if (classname == classname_read) {
+            if (nargin > 1 && mxIsChar(argin[0]) && mx_string_equals(argin[0], classname)) {
                 matched = true;
-                if (command == "_free") {
-                    delete from_mx<T*>(argin[1]);
-                } else if (command == "_saveobj") {
+                if (is_command("_free")) {
+                    T *p = mx_handle_ptr<T>(argin[1]);
+                    mx_handle_hooks<T>::freed(p);
+                    delete p;
+                } else if (is_command("_saveobj")) {
                     argout[0] = to_mx(*from_mx<T*>(argin[1]));
-                } else if (command == "_loadobj") {
+                } else if (is_command("_loadobj")) {
                     argout[0] = to_mx(new T(from_mx<T>(argin[1])));
                 } else matched = false;
             }
             return *this;
         }
 
+        // on_class<mx_buffer<T>> plus "_new"(classname[, capacity]) returning a handle,
+        // "_append"(classname, h, array), "_reserve"(classname, h, n), "_size", "_view" and "_take"
+        template<typename T>
+        MXCommands& on_buffer(const char *classname) {
+            on_class<mx_buffer<T>>(classname);
+            if (matched || nargin < 1 || !mxIsChar(argin[0]) || !mx_string_equals(argin[0], classname))
+                return *this;
+            matched = true;
+            if (is_command("_new")) {
+                argout[0] = to_mx(new mx_buffer<T>(nargin > 1 ? size_from_mx(argin[1], "_new: capacity") : 0));
+                return *this;
+            }
+            if (nargin < 2) {
+                matched = false;
+                return *this;
+            }
+            mx_buffer<T> *b = from_mx<mx_buffer<T>*>(argin[1]);
+            if (is_command("_append") && nargin == 3) {
+                b->append(argin[2]);
+            } else if (is_command("_reserve") && nargin == 3) {
+                b->reserve(size_from_mx(argin[2], "_reserve: n"));
+            } else if (is_command("_size")) {
+                argout[0] = to_mx(static_cast<double>(b->size()));
+            } else if (is_command("_view")) {
+                argout[0] = b->view();
+            } else if (is_command("_take")) {
+                argout[0] = b->take();
+            } else matched = false;
+            return *this;
+        }
+
+        // on_class<mx_ring<T>> plus "_new"(classname, capacity[, channels]) returning a handle,
+        // "_drain"(classname, h[, max[, timeout]]), "_size"(classname, h) and "_stats"(classname, h).
+        // _drain returns up to max frames (all if omitted or Inf), first waiting up to timeout
+        // seconds until max frames, or one if max is Inf, are available.
+        template<typename T>
+        MXCommands& on_ring(const char *classname) {
+            on_class<mx_ring<T>>(classname);
+            if (matched || nargin < 1 || !mxIsChar(argin[0]) || !mx_string_equals(argin[0], classname))
+                return *this;
+            matched = true;
+            if (is_command("_new") && nargin > 1) {
+                size_t capacity = size_from_mx(argin[1], "_new: capacity");
+                size_t channels = nargin > 2 ? size_from_mx(argin[2], "_new: channels") : 1;
+                if (!channels)
+                    throw std::invalid_argument("_new: channels should be at least 1");
+                argout[0] = to_mx(new mx_ring<T>(capacity, channels));
+                return *this;
+            }
+            if (nargin < 2) {
+                matched = false;
+                return *this;
+            }
+            mx_ring<T> *r = from_mx<mx_ring<T>*>(argin[1]);
+            if (is_command("_drain") && nargin <= 4) {
+                double max = nargin > 2 ? from_mx<double>(argin[2]) : std::numeric_limits<double>::infinity();
+                if (!(max >= 0))
+                    throw std::invalid_argument("_drain: max should be a number of frames");
+                size_t frames = max < static_cast<double>(r->capacity()) ? static_cast<size_t>(max) : r->capacity();
+                if (nargin > 3)
+                    r->wait_for(std::isinf(max) ? 1 : frames, std::chrono::duration<double>(from_mx<double>(argin[3])));
+                argout[0] = r->drain(std::isinf(max) ? r->capacity() : frames);
+            } else if (is_command("_size")) {
+                argout[0] = to_mx(static_cast<double>(r->size()));
+            } else if (is_command("_stats")) {
+                argout[0] = r->stats();
+            } else matched = false;
+            return *this;
+        }
+
         template<typename F>
         MXCommands& on(const char *command_, F&& f) {
-            if (command == command_)
+            if (is_command(command_))
                 try {
+                    trace_span span("command", command_);
                     matched = true;
                     mexIt(std::forward<F>(f),nargout, argout, nargin, argin);
                 } catch (const std::exception &) {
                     std::throw_with_nested(
                             std::invalid_argument(
-                                stringer("When calling \"",command,'"')
+                                stringer("When calling \"",get_command(),'"')
                                 )
                             );
                 }
@@ -132,8 +293,9 @@ class MXCommands {
 
         template<typename F>
         MXCommands& on_varargout(const char *command_, F&& f) {
-            if (command == command_) {
+            if (is_command(command_)) {
                 try {
+                    trace_span span("command", command_);
                     matched = true;
                     std::vector<mx_auto> res = runIt(wrap_varargout(std::forward<F>(f),nargout,args_of(f)),nargin,argin);
                     if (nargout != res.size() && (nargout != 0 || res.size() != 1))
@@ -143,7 +305,7 @@ class MXCommands {
                 } catch (const std::exception &e) {
                     std::throw_with_nested(
                             std::invalid_argument(
-                                stringer("When calling \"",command,'"')
+                                stringer("When calling \"",get_command(),'"')
                                 )
                             );
                 }
@@ -151,7 +313,111 @@ class MXCommands {
             return *this;
         }
 
+        // "_cache_stats" and "_cache_clear" for on_memoized results,
+        // "_cached_stats", "_cached_clear" and "_cached_invalidate"(array) for cached<T> arguments
+        MXCommands& on_cache_commands() {
+            if (matched || !mx_string_equals(command_array, "_cache", true))
+                return *this;
+            matched = true;
+            if (is_command("_cache_stats")) {
+                auto &cache = memo_cache();
+                argout[0] = cache_stats_struct(cache.size(), cache.bytes(), cache.get_budget(),
+                                               cache.hits, cache.misses, cache.evictions);
+            } else if (is_command("_cache_clear")) {
+                memo_cache().clear();
+            } else if (is_command("_cached_stats")) {
+                auto &store = cached_store();
+                argout[0] = cache_stats_struct(store.size(), store.bytes(), store.get_budget(),
+                                               store.hits, store.misses, store.evictions);
+            } else if (is_command("_cached_clear")) {
+                cached_store().clear();
+            } else if (is_command("_cached_invalidate") && nargin == 1) {
+                argout[0] = to_mx(static_cast<double>(invalidate_cached(argin[0])));
+            } else matched = false;
+            return *this;
+        }
+
+        // Like on, but outputs are cached by a hash of the raw inputs.
+        // A hit returns copies of the cached arrays without calling f.
+        // Also answers "_cache_stats" and "_cache_clear".
+        template<typename F>
+        MXCommands& on_memoized(const char *command_, F&& f) {
+            on_cache_commands();
+            if (!is_command(command_))
+                return *this;
+            uint64_t hash = hash_mix(0, nargin);
+            for (unsigned i=0; i<nargin; i++)
+                if (!hash_mx(argin[i], hash))
+                    return on(command_, std::forward<F>(f));
+            memo_key key{get_command(), hash, nargout};
+            auto &cache = memo_cache();
+            auto same_inputs = [this](const memo_entry &e) { return e.inputs.same(argin, nargin); };
+            if (auto *hit = cache.find(key, same_inputs)) {
+                trace_span span("command", command_);
+                matched = true;
+                hit->outputs.copy_to(argout);
+                return *this;
+            }
+            on(command_, std::forward<F>(f));
+            memo_entry entry{persistent_arrays(argin, nargin),
+                             persistent_arrays(argout, nargout > 0 ? nargout : 1)};
+            size_t bytes = entry.bytes();
+            cache.insert(key, std::move(entry), bytes);
+            return *this;
+        }
+
+        // "_trace_dump"(file) writes the spans recorded with MEXBIND0X_TRACE as Chrome trace JSON,
+        // "_trace_clear" discards them. Called by MEX_SIMPLE.
+        MXCommands& on_trace_commands() {
+            if (matched || !mx_string_equals(command_array, "_trace", true))
+                return *this;
+            matched = true;
+#ifdef MEXBIND0X_TRACE
+            if (is_command("_trace_dump") && nargin == 1) {
+                argout[0] = to_mx(static_cast<double>(trace_events().dump(from_mx<std::string>(argin[0]))));
+            } else if (is_command("_trace_clear")) {
+                trace_events().clear();
+            } else matched = false;
+#else
+            if (is_command("_trace_dump") || is_command("_trace_clear"))
+                throw std::logic_error("tracing requires compiling with -DMEXBIND0X_TRACE");
+            matched = false;
+#endif
+            return *this;
+        }
+
+        // "_memory" reports the memory of accounted classes (mex_memory.h),
+        // "_memory_budget"(bytes) sets the budget, Inf for none. Called by MEX_SIMPLE.
+        MXCommands& on_memory_commands() {
+            if (matched || !mx_string_equals(command_array, "_memory", true))
+                return *this;
+            matched = true;
+            if (is_command("_memory") && nargin == 0) {
+                argout[0] = object_memory().report();
+            } else if (is_command("_memory_budget") && nargin == 1) {
+                double bytes = from_mx<double>(argin[0]);
+                if (!(bytes >= 0))
+                    throw std::invalid_argument("budget should be a number of bytes");
+                const size_t unlimited = std::numeric_limits<size_t>::max();
+                object_memory().set_budget(bytes >= static_cast<double>(unlimited) ? unlimited
+                                                                                    : static_cast<size_t>(bytes));
+            } else matched = false;
+            return *this;
+        }
+
+        // The library commands answered after the user's by MEX_SIMPLE and "_batch"
+        MXCommands& on_reserved_commands() {
+            on_trace_commands();
+            on_memory_commands();
+            return on_cache_commands();
+        }
+
         const std::string& get_command() {
+            if (command.empty()) {
+                char *command_s = mxArrayToString(command_array);
+                command = command_s;
+                mxFree(command_s);
+            }
             return command;
         }
 
@@ -160,12 +426,135 @@ class MXCommands {
         }
 };
 
-#define MEX_WRAP(f) void mexFunction(int nlhs, mxArray* plhs[], int nrhs, const mxArray * prhs[]) { Profiler prof; try { mexbind0x::mexIt(f,nlhs,plhs,nrhs,prhs); } catch(...) { mexbind0x::flatten_exception(); } }
+// Struct with the runtime's holders, shared cache usage and the stats registry: the pool's
+// threads, completed and pending tasks (0 before it is started) and the hits, misses and
+// evictions of the memo and cached<T> caches of all modules.
+// Stat names are turned into field names by replacing invalid characters with '_'.
+inline mxArray *runtime_stats_struct() {
+    runtime_record_pool_stats();
+    std::vector<std::pair<std::string, double>> values = {
+        {"holders", static_cast<double>(runtime_holders())},
+        {"cache_bytes", static_cast<double>(runtime_cache_budget().used.load())},
+        {"cache_limit", static_cast<double>(runtime_cache_budget().limit.load())},
+    };
+    for (auto &v : runtime_stats().snapshot()) {
+        std::string name = v.first;
+        for (auto &c : name)
+            if (!isalnum(static_cast<unsigned char>(c))) c = '_';
+        if (name.empty() || !isalpha(static_cast<unsigned char>(name[0]))) name = "s" + name;
+        values.emplace_back(name, v.second);
+    }
+    mxArray *res = mxCreateStructMatrix(1, 1, 0, nullptr);
+    for (auto &v : values) {
+        int field = mxGetFieldNumber(res, v.first.c_str());
+        if (field < 0) field = mxAddField(res, v.first.c_str());
+        mxSetFieldByNumber(res, 0, field, mxCreateDoubleScalar(v.second));
+    }
+    return res;
+}
+
+// "_runtime_stats" and "_runtime_cache_limit"(bytes), the limit on all caches of all modules
+inline void runtime_commands(MXCommands &m) {
+    m.on("_runtime_stats", [] { return mx_array_t(runtime_stats_struct()); });
+    m.on("_runtime_cache_limit", [](double bytes) {
+        if (!(bytes >= 0))
+            throw std::invalid_argument("limit should be a number of bytes");
+        runtime_cache_budget().limit = bytes < SIZE_MAX ? static_cast<size_t>(bytes) : SIZE_MAX;
+        memo_cache().set_budget(memo_cache().get_budget());
+        cached_store().set_budget(cached_store().get_budget());
+    });
+}
+
+// "_batch"(entries[, nargout]) where entries is a cell of {command, args...} cells:
+// calls f once per entry with its own MXCommands, followed by on_reserved_commands,
+// inside a single mexFunction call. nargout, a scalar or one count per entry (default 1),
+// is the number of outputs requested from each entry. Returns a cell of results, the
+// output itself for entries with at most one output and a 1 x nargout cell of outputs
+// otherwise, and, as a second output, a cell of error messages ('' on success).
+// A failing entry leaves [] as its result and does not stop the batch.
+// Returns false if the command is not "_batch".
+template<typename F>
+bool run_batch(F&& f, int nargout, mxArray *argout[], int nargin, const mxArray *argin[]) {
+    if (nargin < 1 || !mxIsChar(argin[0]))
+        return false;
+    if (!mx_string_equals(argin[0], "_batch"))
+        return false;
+    if ((nargin != 2 && nargin != 3) || !mxIsCell(argin[1]))
+        throw std::invalid_argument("_batch expects a cell array of {command, args...} cells and optionally output counts");
+    arena_scope scope;
+    trace_span span("command", "_batch");
+    const mxArray *entries = argin[1];
+    size_t n = mxGetNumberOfElements(entries);
+    std::vector<size_t> counts(1, 1);
+    if (nargin == 3) {
+        std::vector<double> requested = from_mx<std::vector<double>>(argin[2]);
+        if (requested.size() != 1 && requested.size() != n)
+            throw std::invalid_argument("_batch output counts should be a scalar or one per entry");
+        // Each count becomes the nargout of an MXCommands
+        for (double c : requested)
+            if (!(c >= 0 && c <= std::numeric_limits<int>::max()) || c != std::floor(c))
+                throw std::invalid_argument("_batch output counts should be whole numbers of outputs");
+        counts.assign(requested.begin(), requested.end());
+    }
+    mxArray *results = mxCreateCellArray(mxGetNumberOfDimensions(entries), mxGetDimensions(entries));
+    mxArray *errors = mxCreateCellArray(mxGetNumberOfDimensions(entries), mxGetDimensions(entries));
+    scratch_vector<const mxArray*> args;
+    scratch_vector<mxArray*> outs;
+    for (size_t i=0; i<n; i++) {
+        const mxArray *entry = mxGetCell(entries, i);
+        size_t count = counts.size() == 1 ? counts[0] : counts[i];
+        outs.clear();
+        std::string error;
+        try {
+            outs.assign(std::max<size_t>(count, 1), nullptr);
+            if (!entry || !mxIsCell(entry) || mxGetNumberOfElements(entry) < 1
+                    || !mxIsChar(mxGetCell(entry, 0)))
+                throw std::invalid_argument(stringer("_batch entry ", i+1, " should be {command, args...}"));
+            args.resize(mxGetNumberOfElements(entry));
+            for (size_t j=0; j<args.size(); j++)
+                args[j] = mxGetCell(entry, j);
+            MXCommands m(count, outs.data(), args.size(), args.data());
+            f(m);
+            m.on_reserved_commands();
+            if (!m.has_matched())
+                throw std::invalid_argument("Command not found");
+        } catch (const std::exception &e) {
+            std::ostringstream s;
+            flatten_exception_str(s, e);
+            error = s.str();
+            for (auto &out : outs) {
+                if (out) mxDestroyArray(out);
+                out = nullptr;
+            }
+        }
+        if (outs.empty()) outs.push_back(nullptr);
+        for (auto &out : outs)
+            if (!out) out = mxCreateDoubleMatrix(0, 0, mxREAL);
+        mxArray *result = outs[0];
+        if (outs.size() > 1) {
+            result = mxCreateCellMatrix(1, outs.size());
+            for (size_t k=0; k<outs.size(); k++)
+                mxSetCell(result, k, outs[k]);
+        }
+        mxSetCell(results, i, result);
+        mxSetCell(errors, i, mxCreateString(error.c_str()));
+    }
+    argout[0] = results;
+    if (nargout > 1)
+        argout[1] = errors;
+    else
+        mxDestroyArray(errors);
+    return true;
+}
+
+#define MEX_WRAP(f) void mexFunction(int nlhs, mxArray* plhs[], int nrhs, const mxArray * prhs[]) { Profiler prof; try { mexbind0x::arena_scope scope; mexbind0x::mexIt(f,nlhs,plhs,nrhs,prhs); } catch(...) { mexbind0x::flatten_exception(); } }
 
 #define MEX_SIMPLE(f) void mexFunction(int nlhs, mxArray* plhs[], int nrhs, const mxArray * prhs[]) {\
     try {\
+        if (mexbind0x::run_batch(f,nlhs,plhs,nrhs,prhs)) return;\
         mexbind0x::MXCommands m(nlhs,plhs,nrhs,prhs);\
         f(m);\
+        m.on_reserved_commands();\
         if (!m.has_matched()) throw std::invalid_argument("Command not found");\
     } catch(...) { mexbind0x::flatten_exception(); } }
 }
@@ -0,0 +1,53 @@
+#pragma once
+#include "runtime.h"
+#include <mex.h>
+#include <functional>
+#include <vector>
+
+namespace mexbind0x {
+// mexAtExit accepts a single function per MEX file, so every component that
+// needs to release persistent state registers here instead.
+inline std::vector<std::function<void()>>& at_exit_handlers() {
+    static std::vector<std::function<void()>> handlers;
+    return handlers;
+}
+
+inline void run_at_exit_handlers() {
+    auto &handlers = at_exit_handlers();
+    while (!handlers.empty()) {
+        auto f = std::move(handlers.back());
+        handlers.pop_back();
+        f();
+    }
+}
+
+// Handlers run in reverse order of registration when the MEX file is cleared
+inline void at_mex_exit(std::function<void()> f) {
+    auto &handlers = at_exit_handlers();
+    if (handlers.empty())
+        mexAtExit(run_at_exit_handlers);
+    handlers.push_back(std::move(f));
+}
+
+// A flag per Tag type, reset when the MEX file is cleared
+template<typename Tag>
+bool& module_flag() {
+    static bool flag = false;
+    return flag;
+}
+
+// Holds a reference to the runtime (runtime.h) until the MEX file is cleared
+inline void acquire_runtime() {
+    static bool acquired = false;
+    if (acquired) return;
+    runtime_acquire();
+    acquired = true;
+    at_mex_exit([] { runtime_release(); acquired = false; });
+}
+
+// The worker pool shared by all modules when the runtime library is used
+inline thread_pool& mex_pool() {
+    acquire_runtime();
+    return runtime_pool();
+}
+} // namespace mexbind0x
@@ -0,0 +1,386 @@
+#pragma once
+// Memory accounting for objects held by MATLAB through on_class handles.
+// A class opts in with ACCOUNTED(x, policy) inside namespace mexbind0x:
+//   none       counted only
+//   serialize  spilled with save_load to a file in spill_dir, reset to x() and
+//              reloaded on the next use of its handle
+//   recompute  mx_evict(x&) drops what can be rebuilt, mx_restore(x&) rebuilds it
+//              (both found by argument-dependent lookup)
+// The size of an object is memory_size(const x&) if declared, sizeof(x) otherwise;
+// containers using tracked_allocator<T, x> are counted as well.
+// When the total exceeds the budget the least recently used spillable objects are
+// spilled, except those used during the current mexFunction call.
+// The registry is used on the MATLAB thread only.
+#include "mex_cast.h"
+#include "mex_lifecycle.h"
+#include "mex_arena.h"
+#include "byte_archive.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iterator>
+#include <limits>
+#include <map>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <typeindex>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+namespace mexbind0x {
+enum class mx_spill { none, serialize, recompute };
+
+template<typename T> struct mx_accounting {
+    static constexpr bool enabled = false;
+    static constexpr mx_spill spill = mx_spill::none;
+};
+
+template<mx_spill S> struct mx_accounted {
+    static constexpr bool enabled = true;
+    static constexpr mx_spill spill = S;
+};
+
+#define ACCOUNTED(x, policy) template<> struct mx_accounting<x> : mx_accounted<mx_spill::policy> {}
+
+// Heap bytes allocated through tracked_allocator<T, Class> for any T
+template<typename Class>
+std::atomic<size_t>& tracked_bytes() {
+    static std::atomic<size_t> bytes{0};
+    return bytes;
+}
+
+template<typename T, typename Class>
+struct tracked_allocator {
+    using value_type = T;
+
+    tracked_allocator() = default;
+    template<typename U>
+    tracked_allocator(const tracked_allocator<U, Class>&) {}
+
+    T *allocate(size_t n) {
+        T *p = std::allocator<T>().allocate(n);
+        tracked_bytes<Class>() += n * sizeof(T);
+        return p;
+    }
+
+    void deallocate(T *p, size_t n) {
+        tracked_bytes<Class>() -= n * sizeof(T);
+        std::allocator<T>().deallocate(p, n);
+    }
+
+    template<typename U>
+    bool operator==(const tracked_allocator<U, Class>&) const { return true; }
+    template<typename U>
+    bool operator!=(const tracked_allocator<U, Class>&) const { return false; }
+};
+
+template<typename T, typename = void>
+struct has_memory_size : std::false_type {};
+template<typename T>
+struct has_memory_size<T, decltype((void)memory_size(std::declval<const T&>()))> : std::true_type {};
+
+template<typename T>
+std::enable_if_t<has_memory_size<T>::value, size_t> object_size(const T &t) {
+    return memory_size(t);
+}
+
+template<typename T>
+std::enable_if_t<!has_memory_size<T>::value, size_t> object_size(const T &) {
+    return sizeof(T);
+}
+
+using spill_policy = std::integral_constant<mx_spill, mx_spill::serialize>;
+using recompute_policy = std::integral_constant<mx_spill, mx_spill::recompute>;
+
+template<typename T>
+void spill_object(T &t, const std::string &path, spill_policy) {
+    ByteSaver s;
+    s << t;
+    std::ofstream f(path, std::ios::binary);
+    f.write(s.bytes().data(), s.bytes().size());
+    f.close();
+    if (!f)
+        throw std::runtime_error("cannot write spill file " + path);
+    t = T();
+}
+
+template<typename T>
+void restore_object(T &t, const std::string &path, spill_policy) {
+    std::ifstream f(path, std::ios::binary);
+    if (!f)
+        throw std::runtime_error("cannot read spill file " + path);
+    std::vector<char> bytes((std::istreambuf_iterator<char>(f)), std::istreambuf_iterator<char>());
+    T loaded;
+    ByteLoader l(bytes.data(), bytes.size());
+    l >> loaded;
+    t = std::move(loaded);
+    f.close();
+    std::remove(path.c_str());
+}
+
+template<typename T>
+void spill_object(T &t, const std::string &, recompute_policy) {
+    mx_evict(t);
+}
+
+template<typename T>
+void restore_object(T &t, const std::string &, recompute_policy) {
+    mx_restore(t);
+}
+
+class memory_registry {
+    struct class_account {
+        std::string name;
+        const std::atomic<size_t> *tracked;
+        size_t objects = 0, bytes = 0, spilled = 0, spilled_bytes = 0;
+    };
+
+    struct entry {
+        class_account *account = nullptr;
+        size_t bytes = 0;         // resident, refreshed on use
+        bool spilled = false;
+        size_t spilled_bytes = 0; // released by spilling
+        uint64_t last_use = 0;    // key in lru
+        uint64_t call = 0;        // mex_call_number() of the last use
+        size_t (*size)(const void*) = nullptr;
+        void (*spill)(void*, const std::string&) = nullptr;
+        void (*restore)(void*, const std::string&) = nullptr;
+    };
+
+    template<typename T>
+    struct ops {
+        using policy = std::integral_constant<mx_spill, mx_accounting<T>::spill>;
+        static size_t size(const void *p) {
+            return object_size(*static_cast<const T*>(p));
+        }
+        static void spill(void *p, const std::string &path) {
+            spill_object(*static_cast<T*>(p), path, policy());
+        }
+        static void restore(void *p, const std::string &path) {
+            restore_object(*static_cast<T*>(p), path, policy());
+        }
+    };
+
+    std::map<std::type_index, class_account> accounts;
+    std::unordered_map<const void*, entry> objects;
+    std::map<uint64_t, void*> lru; // resident spillable objects by last use
+    uint64_t clock = 0;
+    size_t resident = 0;
+    size_t budget_ = std::numeric_limits<size_t>::max();
+    std::string prefix;
+
+    template<typename T>
+    class_account& account() {
+        auto r = accounts.emplace(std::type_index(typeid(T)), class_account{get_type_name<T>(), &tracked_bytes<T>()});
+        return r.first->second;
+    }
+
+    template<typename T>
+    static void bind_spill(entry &e, std::integral_constant<mx_spill, mx_spill::none>) {
+        e.spill = nullptr;
+        e.restore = nullptr;
+    }
+
+    template<typename T, mx_spill S>
+    static void bind_spill(entry &e, std::integral_constant<mx_spill, S>) {
+        e.spill = &ops<T>::spill;
+        e.restore = &ops<T>::restore;
+    }
+
+    std::string path(const void *p) const {
+        return stringer(spill_dir, "/", prefix, reinterpret_cast<uintptr_t>(p), ".bin");
+    }
+
+    void resize(entry &e, size_t bytes) {
+        e.account->bytes += bytes - e.bytes;
+        resident += bytes - e.bytes;
+        e.bytes = bytes;
+    }
+
+    void use(void *p, entry &e) {
+        e.call = mex_call_number();
+        if (!e.spill) return;
+        lru.erase(e.last_use);
+        e.last_use = ++clock;
+        lru.emplace(e.last_use, p);
+    }
+
+    // Spills the least recently used object not in use by the current call.
+    // Objects that fail to spill stay resident and are added to failed.
+    bool spill_one(std::unordered_set<const void*> &failed) {
+        for (auto it = lru.begin(); it != lru.end(); ++it) {
+            entry &e = objects.at(it->second);
+            if (arena_scope_depth() > 0 && e.call == mex_call_number()) continue;
+            void *p = it->second;
+            if (failed.count(p)) continue;
+            size_t before = e.size(p) + e.account->tracked->load();
+            try {
+                e.spill(p, path(p));
+            } catch (...) {
+                std::remove(path(p).c_str());
+                resize(e, e.size(p));
+                failed.insert(p);
+                continue;
+            }
+            resize(e, e.size(p));
+            before -= std::min(before, e.bytes + e.account->tracked->load());
+            e.spilled = true;
+            e.spilled_bytes = before;
+            e.account->spilled++;
+            e.account->spilled_bytes += before;
+            lru.erase(it);
+            return true;
+        }
+        return false;
+    }
+
+public:
+    std::string spill_dir;
+
+    memory_registry() {
+#ifdef _WIN32
+        const char *tmp = std::getenv("TEMP");
+        spill_dir = tmp && *tmp ? tmp : ".";
+#else
+        const char *tmp = std::getenv("TMPDIR");
+        spill_dir = tmp && *tmp ? tmp : "/tmp";
+#endif
+        uint64_t stamp = std::chrono::steady_clock::now().time_since_epoch().count();
+        prefix = stringer("mexbind0x_spill_", stamp ^ reinterpret_cast<uintptr_t>(this), "_");
+    }
+
+    memory_registry(const memory_registry&) = delete;
+    memory_registry& operator=(const memory_registry&) = delete;
+
+    ~memory_registry() {
+        for (auto &o : objects)
+            if (o.second.spilled)
+                std::remove(path(o.first).c_str());
+    }
+
+    template<typename T>
+    void add(T *p) {
+        entry e;
+        e.account = &account<T>();
+        e.size = &ops<T>::size;
+        bind_spill<T>(e, typename ops<T>::policy());
+        auto r = objects.emplace(p, e);
+        if (!r.second) return;
+        r.first->second.account->objects++;
+        resize(r.first->second, e.size(p));
+        use(p, r.first->second);
+        enforce();
+    }
+
+    // Restores a spilled object and marks it as used by the current call.
+    // Throws only if the object cannot be restored, it then stays spilled.
+    void touch(void *p) {
+        auto it = objects.find(p);
+        if (it == objects.end()) return;
+        entry &e = it->second;
+        if (e.spilled) {
+            e.restore(p, path(p));
+            e.account->spilled--;
+            e.account->spilled_bytes -= e.spilled_bytes;
+            e.spilled = false;
+        }
+        resize(e, e.size(p));
+        use(p, e);
+        enforce();
+    }
+
+    void remove(void *p) {
+        auto it = objects.find(p);
+        if (it == objects.end()) return;
+        entry &e = it->second;
+        if (e.spilled) {
+            std::remove(path(p).c_str());
+            e.account->spilled--;
+            e.account->spilled_bytes -= e.spilled_bytes;
+        }
+        resize(e, 0);
+        e.account->objects--;
+        if (e.spill) lru.erase(e.last_use);
+        objects.erase(it);
+    }
+
+    // Resident bytes of the objects plus their tracked allocations
+    size_t total() const {
+        size_t res = resident;
+        for (auto &a : accounts) res += a.second.tracked->load();
+        return res;
+    }
+
+    size_t budget() const {
+        return budget_;
+    }
+
+    void set_budget(size_t bytes) {
+        budget_ = bytes;
+        enforce();
+    }
+
+    // Does not throw: objects that fail to spill are left resident
+    void enforce() {
+        std::unordered_set<const void*> failed;
+        while (total() > budget_ && spill_one(failed)) {}
+    }
+
+    // Sizes of objects changed since their last use are picked up here
+    void refresh() {
+        for (auto &o : objects)
+            resize(o.second, o.second.size(o.first));
+    }
+
+    // Struct with total, budget (Inf if unlimited), spilled (bytes) and classes,
+    // a struct array of name, objects, bytes, tracked, spilled and spilled_bytes
+    mxArray *report() {
+        refresh();
+        const char *fields[] = {"total", "budget", "spilled", "classes"};
+        const char *class_fields[] = {"name", "objects", "bytes", "tracked", "spilled", "spilled_bytes"};
+        mxArray *classes = mxCreateStructMatrix(accounts.size(), 1, 6, class_fields);
+        size_t i = 0, spilled = 0;
+        for (auto &a : accounts) {
+            const class_account &c = a.second;
+            mxSetFieldByNumber(classes, i, 0, mxCreateString(c.name.c_str()));
+            mxSetFieldByNumber(classes, i, 1, mxCreateDoubleScalar(c.objects));
+            mxSetFieldByNumber(classes, i, 2, mxCreateDoubleScalar(c.bytes));
+            mxSetFieldByNumber(classes, i, 3, mxCreateDoubleScalar(c.tracked->load()));
+            mxSetFieldByNumber(classes, i, 4, mxCreateDoubleScalar(c.spilled));
+            mxSetFieldByNumber(classes, i, 5, mxCreateDoubleScalar(c.spilled_bytes));
+            spilled += c.spilled_bytes;
+            i++;
+        }
+        mxArray *res = mxCreateStructMatrix(1, 1, 4, fields);
+        mxSetFieldByNumber(res, 0, 0, mxCreateDoubleScalar(total()));
+        mxSetFieldByNumber(res, 0, 1, mxCreateDoubleScalar(budget_ == std::numeric_limits<size_t>::max()
+                                                           ? std::numeric_limits<double>::infinity() : budget_));
+        mxSetFieldByNumber(res, 0, 2, mxCreateDoubleScalar(spilled));
+        mxSetFieldByNumber(res, 0, 3, classes);
+        return res;
+    }
+};
+
+// Spill files left when the MEX file is cleared are deleted
+inline memory_registry& object_memory() {
+    static memory_registry *registry = nullptr;
+    if (!registry) {
+        registry = new memory_registry();
+        at_mex_exit([] { delete registry; registry = nullptr; });
+    }
+    return *registry;
+}
+
+template<typename T>
+struct mx_handle_hooks<T, std::enable_if_t<mx_accounting<T>::enabled>> {
+    static void created(T *p) { object_memory().add(p); }
+    static void used(T *p) { object_memory().touch(p); }
+    static void freed(T *p) { object_memory().remove(p); }
+};
+} // namespace mexbind0x
@@ -2,6 +2,7 @@
 #include "mex_cast.h"
 #include "mex_array.h"
 #include "func_types.h"
+#include "trace.h"
 #include <mex.h>
 #include <stdexcept>
 #include <sstream>
@@ -35,8 +36,10 @@ typename std::enable_if< (i < std::tuple_size<Tup>::value), void>::type
 save_tuple(Tup &&tup, int nlhs, mxArray *plhs[])
 {
     if (i < nlhs || (i==0 && nlhs==0)) {
+        trace_span span("output", "to_mx");
         try {
             plhs[i] = to_mx(std::get<i>(tup));
+            span.describe(i, plhs[i]);
         } catch (...) {
             std::throw_with_nested(std::invalid_argument(
                         stringer("in output #", i)
@@ -46,10 +49,43 @@ save_tuple(Tup &&tup, int nlhs, mxArray *plhs[])
     }
 }
 
+template<typename T, typename = void>
+struct has_mex_classid : std::false_type {};
 template<typename T>
-typename T::first_type get_array(const mxArray* a[]) {
+struct has_mex_classid<T, decltype((void)get_mex_classid<T>::value)> : std::true_type {};
+
+template<typename T>
+std::enable_if_t<!(std::is_arithmetic<T>::value && has_mex_classid<T>::value), T>
+from_mx_arg(const mxArray *m) {
+    return from_mx<T>(m);
+}
+
+// Real scalars of the exact class or double are read directly, anything else goes through from_mx
+template<typename T>
+std::enable_if_t<std::is_arithmetic<T>::value && has_mex_classid<T>::value, T>
+from_mx_arg(const mxArray *m) {
+    if (mxGetNumberOfElements(m) == 1 && !mxIsComplex(m) && !mxIsSparse(m)) {
+        mxClassID id = mxGetClassID(m);
+        if (id == get_mex_classid<T>::value)
+            return *static_cast<const T*>(mxGetData(m));
+        if (id == mxDOUBLE_CLASS)
+            return static_cast<T>(*static_cast<const double*>(mxGetData(m)));
+    }
+    return from_mx<T>(m);
+}
+
+template<typename T>
+std::enable_if_t<injected_arg<typename T::first_type>::value, typename T::first_type>
+get_array(const mxArray*[]) {
+    return injected_arg<typename T::first_type>::get();
+}
+
+template<typename T>
+std::enable_if_t<!injected_arg<typename T::first_type>::value, typename T::first_type>
+get_array(const mxArray* a[]) {
+    trace_span span("argument", "from_mx", T::second_type::value, a[T::second_type::value]);
     try {
-        return from_mx<typename T::first_type>(a[T::second_type::value]);
+        return from_mx_arg<typename T::first_type>(a[T::second_type::value]);
     } catch (...) {
         std::throw_with_nested(argument_cast_exception(T::second_type::value));
     }
@@ -83,9 +119,10 @@ auto callFuncArgs(F&& f, const mxArray* prhs[], types_t<Args...>)
 template<typename F>
 auto runIt(F&& f, int nrhs, const mxArray *prhs[]) {
     auto counted_args = count_args(args_of(f));
-    if (counted_args.size != nrhs)
+    constexpr int expected = consumed_args(decltype(args_of(f))());
+    if (expected != nrhs)
         throw std::invalid_argument(stringer(
-                    "number of arguments mismatch: expected ", (int)counted_args.size,
+                    "number of arguments mismatch: expected ", expected,
                     ", received", nrhs
                     ));
     return callFuncArgs(std::forward<F>(f), prhs, counted_args);
@@ -109,8 +146,10 @@ template<typename F>
 typename std::enable_if<!std::is_same<return_of<F>,void>::value && !is_tuple_v<return_of<F>> >::type
 mexIt(F&& f, int, mxArray *plhs[], int nrhs, const mxArray *prhs[]) {
     decltype(auto) res = runIt(std::forward<F>(f),nrhs, prhs);
+    trace_span span("output", "to_mx");
     try {
         plhs[0] = to_mx(std::move(res));
+        span.describe(0, plhs[0]);
     } catch (...) {
         std::throw_with_nested(std::invalid_argument("in output #0"));
     }
@@ -0,0 +1,197 @@
+#pragma once
+#include "mex_cast.h"
+#include "trace.h"
+#include <algorithm>
+#include <condition_variable>
+#include <cstring>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+
+namespace mexbind0x {
+// Memory a single mx_stream may use for its converted chunks (two buffers).
+inline size_t& mx_stream_budget() {
+    static size_t budget = 64 << 20;
+    return budget;
+}
+
+// Argument type that passes the input to the user function in converted chunks.
+// for_each_chunk(f) calls f(const T *chunk, size_t count, size_t offset) in order.
+// The next chunk is converted on a helper thread, started once per call, while f
+// processes the current one.
+// If the MATLAB class already is T, chunks point directly into the input.
+template<typename T>
+class mx_stream {
+    const mxArray *m;
+    mx_converter<T> conv;
+    const void *data;
+    size_t numel;
+    size_t budget;
+    bool same_class;
+public:
+    static constexpr bool can_mex_cast = true;
+    mx_stream(const mxArray *m)
+        : m(m), budget(mx_stream_budget())
+    {
+        if (mxIsComplex(m)) throw std::invalid_argument("should be real");
+        conv = make_mx_converter<T>(m);
+        data = mxGetData(m);
+        numel = mxGetNumberOfElements(m);
+        same_class = mxGetClassID(m) == get_mex_classid<T>::value;
+    }
+
+    size_t size() const {
+        return numel;
+    }
+
+    const mwSize *dimensions() const {
+        return mxGetDimensions(m);
+    }
+
+    size_t ndims() const {
+        return mxGetNumberOfDimensions(m);
+    }
+
+    void set_budget(size_t bytes) {
+        budget = bytes;
+    }
+
+    size_t chunk_size() const {
+        return std::max<size_t>(budget / (2*sizeof(T)), 1);
+    }
+
+    template<typename F>
+    void for_each_chunk(F&& f) const {
+        size_t chunk = std::min(chunk_size(), numel);
+        if (numel == 0) return;
+        if (same_class) {
+            const T *src = static_cast<const T*>(data);
+            for (size_t offset=0; offset<numel; offset+=chunk)
+                f(src + offset, std::min(chunk, numel-offset), offset);
+            return;
+        }
+        std::unique_ptr<T[]> buffers[2] = {std::unique_ptr<T[]>(new T[chunk]),
+                                           std::unique_ptr<T[]>(new T[chunk])};
+        size_t chunks = (numel + chunk - 1) / chunk;
+        std::mutex mutex;
+        std::condition_variable cv;
+        size_t converted = 0, consumed = 0; // chunks
+        bool stop = false;
+        std::exception_ptr error;
+        // Converts chunk k once chunk k-2, the previous user of its buffer, is consumed
+        std::thread helper([&] {
+            for (size_t k=0; k<chunks; k++) {
+                {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    cv.wait(lock, [&] { return stop || k < consumed + 2; });
+                    if (stop) return;
+                }
+                try {
+                    trace_span span("worker", "mx_stream chunk");
+                    size_t offset = k * chunk;
+                    conv.gather(data, offset, 1, std::min(chunk, numel-offset), buffers[k%2].get());
+                } catch (...) {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    error = std::current_exception();
+                    cv.notify_all();
+                    return;
+                }
+                std::lock_guard<std::mutex> lock(mutex);
+                converted = k + 1;
+                cv.notify_all();
+            }
+        });
+        try {
+            for (size_t k=0; k<chunks; k++) {
+                {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    cv.wait(lock, [&] { return converted > k || error; });
+                    if (error) std::rethrow_exception(error);
+                }
+                size_t offset = k * chunk;
+                f(static_cast<const T*>(buffers[k%2].get()), std::min(chunk, numel-offset), offset);
+                std::lock_guard<std::mutex> lock(mutex);
+                consumed = k + 1;
+                cv.notify_all();
+            }
+        } catch (...) {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                stop = true;
+            }
+            cv.notify_all();
+            helper.join();
+            throw;
+        }
+        helper.join();
+    }
+};
+
+// Result type that fills the output mxArray incrementally, without an intermediate copy.
+template<typename T>
+class mx_stream_writer {
+    mxArray *res;
+    T *dst;
+    size_t numel;
+    size_t pos = 0;
+public:
+    mx_stream_writer(size_t rows, size_t cols = 1)
+        : res(mxCreateNumericMatrix(rows, cols, get_mex_classid<T>::value, mxREAL))
+        , dst(static_cast<T*>(mxGetData(res)))
+        , numel(mxGetNumberOfElements(res)) {}
+
+    mx_stream_writer(size_t ndims, const mwSize *dims)
+        : res(mxCreateNumericArray(ndims, dims, get_mex_classid<T>::value, mxREAL))
+        , dst(static_cast<T*>(mxGetData(res)))
+        , numel(mxGetNumberOfElements(res)) {}
+
+    mx_stream_writer(const mx_stream_writer&) = delete;
+    mx_stream_writer(mx_stream_writer &&o)
+        : res(o.res), dst(o.dst), numel(o.numel), pos(o.pos) {
+        o.res = nullptr;
+    }
+
+    // Reserves the next count elements of the output to be filled in place
+    T *next(size_t count) {
+        if (count > numel - pos)
+            throw std::out_of_range("mx_stream_writer: output is full");
+        T *res = dst + pos;
+        pos += count;
+        return res;
+    }
+
+    template<typename U>
+    void write(const U *chunk, size_t count) {
+        T *out = next(count);
+        if (std::is_same<T,U>::value)
+            memcpy(out, chunk, count*sizeof(T));
+        else
+            for (size_t i=0; i<count; i++) out[i] = static_cast<T>(chunk[i]);
+    }
+
+    size_t size() const {
+        return numel;
+    }
+
+    size_t position() const {
+        return pos;
+    }
+
+    mxArray *release() {
+        if (!res)
+            throw std::logic_error("mx_stream_writer: output already released");
+        if (pos != numel)
+            throw std::length_error(stringer("mx_stream_writer: wrote ", pos, " of ", numel, " elements"));
+        mxArray *r = res;
+        res = nullptr;
+        return r;
+    }
+};
+
+template<typename T>
+mxArray *to_mx(mx_stream_writer<T> &&w) {
+    return w.release();
+}
+} // namespace mexbind0x
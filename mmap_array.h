@@ -0,0 +1,303 @@
+#pragma once
+#ifdef _WIN32
+#error "mmap_array.h requires POSIX mmap"
+#endif
+#include "mex_commands.h"
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace mexbind0x {
+enum class mmap_access { normal, sequential, random };
+
+struct mmap_class_info {
+    const char *name;
+    mxClassID id;
+    size_t size;
+};
+
+inline const mmap_class_info& mmap_class(mxClassID id) {
+    static const mmap_class_info classes[] = {
+        {"double", mxDOUBLE_CLASS, 8}, {"single", mxSINGLE_CLASS, 4},
+        {"int8", mxINT8_CLASS, 1}, {"uint8", mxUINT8_CLASS, 1},
+        {"int16", mxINT16_CLASS, 2}, {"uint16", mxUINT16_CLASS, 2},
+        {"int32", mxINT32_CLASS, 4}, {"uint32", mxUINT32_CLASS, 4},
+        {"int64", mxINT64_CLASS, 8}, {"uint64", mxUINT64_CLASS, 8},
+        {"logical", mxLOGICAL_CLASS, 1}, {"char", mxCHAR_CLASS, sizeof(mxChar)},
+    };
+    for (const auto &c : classes)
+        if (c.id == id) return c;
+    throw std::invalid_argument(stringer("class ", static_cast<int>(id), " cannot be mapped"));
+}
+
+inline const mmap_class_info& mmap_class(const std::string &name) {
+    for (mxClassID id : {mxDOUBLE_CLASS, mxSINGLE_CLASS, mxINT8_CLASS, mxUINT8_CLASS,
+                         mxINT16_CLASS, mxUINT16_CLASS, mxINT32_CLASS, mxUINT32_CLASS,
+                         mxINT64_CLASS, mxUINT64_CLASS, mxLOGICAL_CLASS, mxCHAR_CLASS})
+        if (name == mmap_class(id).name) return mmap_class(id);
+    throw std::invalid_argument(stringer("class ", name, " cannot be mapped"));
+}
+
+// Layout of an array stored in a file: raw data of class classid, column-major, at offset
+struct mmap_spec {
+    std::string path;
+    mxClassID classid = mxDOUBLE_CLASS;
+    std::vector<size_t> shape;
+    size_t offset = 0;
+    mmap_access access = mmap_access::normal;
+
+    size_t numel() const {
+        size_t n = 1;
+        for (size_t d : shape) n = checked_extent_product(n, d);
+        return n;
+    }
+
+    size_t bytes() const {
+        return checked_extent_product(numel(), mmap_class(classid).size);
+    }
+
+    template<typename SaveLoader>
+    friend void save_load(SaveLoader &s, mmap_spec &spec) {
+        int classid = spec.classid, access = static_cast<int>(spec.access);
+        double offset = static_cast<double>(spec.offset);
+        s & spec.path & classid & spec.shape & offset & access;
+        spec.classid = static_cast<mxClassID>(classid);
+        spec.offset = static_cast<size_t>(offset);
+        spec.access = static_cast<mmap_access>(access);
+    }
+};
+
+// Self-describing files start with
+//   char magic[8] = "MXBMAP01"; uint32 classid; uint32 ndims; uint64 dims[ndims];
+// and the data follows at the next multiple of 64 bytes.
+constexpr char mmap_file_magic[8] = {'M','X','B','M','A','P','0','1'};
+
+inline size_t mmap_header_size(size_t ndims) {
+    return (16 + 8*ndims + 63) / 64 * 64;
+}
+
+inline mmap_spec mmap_read_header(const std::string &path) {
+    std::ifstream f(path, std::ios::binary);
+    if (!f)
+        throw std::runtime_error(stringer("cannot open ", path));
+    char magic[8];
+    uint32_t classid, ndims;
+    f.read(magic, 8);
+    f.read(reinterpret_cast<char*>(&classid), 4);
+    f.read(reinterpret_cast<char*>(&ndims), 4);
+    if (!f || memcmp(magic, mmap_file_magic, 8) != 0 || ndims > 64)
+        throw std::invalid_argument(stringer(path, " does not start with an array header"));
+    mmap_spec spec;
+    spec.path = path;
+    spec.classid = mmap_class(static_cast<mxClassID>(classid)).id;
+    std::vector<uint64_t> dims(ndims);
+    f.read(reinterpret_cast<char*>(dims.data()), 8*ndims);
+    if (!f)
+        throw std::invalid_argument(stringer(path, ": truncated array header"));
+    spec.shape.assign(dims.begin(), dims.end());
+    spec.offset = mmap_header_size(ndims);
+    return spec;
+}
+
+// Writes a numeric array in the self-describing format
+inline void mmap_write(const std::string &path, const mxArray *m) {
+    if (mxIsComplex(m) || mxIsSparse(m))
+        throw std::invalid_argument("only real full arrays can be written");
+    const mmap_class_info &c = mmap_class(mxGetClassID(m));
+    uint32_t classid = c.id, ndims = static_cast<uint32_t>(mxGetNumberOfDimensions(m));
+    std::vector<char> header(mmap_header_size(ndims));
+    memcpy(header.data(), mmap_file_magic, 8);
+    memcpy(header.data() + 8, &classid, 4);
+    memcpy(header.data() + 12, &ndims, 4);
+    for (uint32_t i=0; i<ndims; i++) {
+        uint64_t d = mxGetDimensions(m)[i];
+        memcpy(header.data() + 16 + 8*i, &d, 8);
+    }
+    std::ofstream f(path, std::ios::binary | std::ios::trunc);
+    f.write(header.data(), header.size());
+    f.write(static_cast<const char*>(mxGetData(m)), mxGetNumberOfElements(m) * c.size);
+    if (!f)
+        throw std::runtime_error(stringer("cannot write ", path));
+}
+
+// Array layout from MATLAB: a path to a self-describing file, or a struct with
+// fields path, shape and optionally class, offset and access ('sequential', 'random').
+inline mmap_spec mmap_spec_from_mx(const mxArray *m, mxClassID default_class) {
+    if (mxIsChar(m))
+        return mmap_read_header(from_mx<std::string>(m));
+    if (!mxIsStruct(m) || mxGetNumberOfElements(m) != 1)
+        throw std::invalid_argument("expected a file name or a struct with path and shape");
+    auto field = [m](const char *name) { return mxGetField(m, 0, name); };
+    if (!field("path"))
+        throw std::invalid_argument("missing field path");
+    mmap_spec spec;
+    spec.path = from_mx<std::string>(field("path"));
+    if (field("shape")) {
+        spec.shape = from_mx<std::vector<size_t>>(field("shape"));
+        spec.classid = field("class") ? mmap_class(from_mx<std::string>(field("class"))).id
+                                      : default_class;
+        if (field("offset")) spec.offset = from_mx<size_t>(field("offset"));
+    } else {
+        spec = mmap_read_header(spec.path);
+    }
+    if (field("access")) {
+        std::string access = from_mx<std::string>(field("access"));
+        if (access == "sequential") spec.access = mmap_access::sequential;
+        else if (access == "random") spec.access = mmap_access::random;
+        else if (access != "normal")
+            throw std::invalid_argument(stringer("unknown access pattern ", access));
+    }
+    return spec;
+}
+
+// Read-only mapping of spec.bytes() bytes at spec.offset of a file
+class mapped_file {
+    void *base = nullptr;
+    size_t length = 0;
+    const char *start = nullptr;
+public:
+    mmap_spec spec;
+
+    explicit mapped_file(mmap_spec s) : spec(std::move(s)) {
+        size_t bytes = spec.bytes();
+        int fd = open(spec.path.c_str(), O_RDONLY);
+        if (fd < 0)
+            throw std::runtime_error(stringer("cannot open ", spec.path, ": ", strerror(errno)));
+        struct stat st;
+        if (fstat(fd, &st) != 0 || spec.offset > static_cast<size_t>(st.st_size)
+                || bytes > static_cast<size_t>(st.st_size) - spec.offset) {
+            close(fd);
+            throw std::invalid_argument(stringer(spec.path, " is smaller than ", spec.offset + bytes, " bytes"));
+        }
+        size_t page = sysconf(_SC_PAGESIZE);
+        size_t aligned = spec.offset / page * page;
+        length = spec.offset - aligned + bytes;
+        if (length) {
+            base = mmap(nullptr, length, PROT_READ, MAP_SHARED, fd, aligned);
+            if (base == MAP_FAILED) {
+                close(fd);
+                throw std::runtime_error(stringer("mmap of ", spec.path, " failed: ", strerror(errno)));
+            }
+            start = static_cast<const char*>(base) + (spec.offset - aligned);
+        }
+        close(fd);
+        advise(spec.access);
+    }
+
+    mapped_file(const mapped_file&) = delete;
+    mapped_file& operator=(const mapped_file&) = delete;
+
+    ~mapped_file() {
+        if (base) munmap(base, length);
+    }
+
+    void advise(mmap_access access) {
+        spec.access = access;
+        if (!base) return;
+        int advice = access == mmap_access::sequential ? MADV_SEQUENTIAL
+                   : access == mmap_access::random ? MADV_RANDOM : MADV_NORMAL;
+        madvise(base, length, advice);
+    }
+
+    const void *data() const {
+        return start;
+    }
+
+    size_t size() const {
+        return spec.bytes();
+    }
+};
+
+// Argument that maps a file read-only as an NDArrayView, see mmap_spec_from_mx.
+// Trailing dimensions of the file are folded into the last dimension of the view.
+template<typename T, int N>
+struct mmap_array : NDArrayView<const T, N> {
+    static constexpr bool can_mex_cast = true;
+    std::shared_ptr<mapped_file> file;
+
+    explicit mmap_array(const mmap_spec &spec) : file(std::make_shared<mapped_file>(spec)) {
+        if (spec.classid != get_mex_classid<T>::value || mmap_class(spec.classid).size != sizeof(T))
+            throw std::invalid_argument(stringer(spec.path, " holds ", mmap_class(spec.classid).name,
+                                                 " data, expected ", get_type_name<T>()));
+        this->m_data = static_cast<const T*>(file->data());
+        size_t mult = 1;
+        for (size_t i=0; i<N; i++) {
+            size_t d = i < spec.shape.size() ? spec.shape[i] : 1;
+            if (i == N-1)
+                for (size_t j=N; j<spec.shape.size(); j++) d = checked_extent_product(d, spec.shape[j]);
+            this->dimensions[i] = {mult, d};
+            mult = checked_extent_product(mult, d);
+        }
+    }
+
+    explicit mmap_array(const std::string &path) : mmap_array(mmap_read_header(path)) {}
+
+    mmap_array(const mxArray *m) : mmap_array(mmap_spec_from_mx(m, get_mex_classid<T>::value)) {}
+
+    void advise(mmap_access access) {
+        file->advise(access);
+    }
+};
+
+// Mapping kept alive in MATLAB through on_class<mmap_handle>, data is read in slices.
+// saveobj stores the layout only, loadobj maps the file again.
+class mmap_handle {
+    std::shared_ptr<mapped_file> file;
+public:
+    mmap_handle() = default;
+    explicit mmap_handle(const mmap_spec &spec) : file(std::make_shared<mapped_file>(spec)) {}
+
+    const mmap_spec& spec() const {
+        if (!file)
+            throw std::logic_error("mmap_handle is not mapped");
+        return file->spec;
+    }
+
+    std::vector<double> size() const {
+        return std::vector<double>(spec().shape.begin(), spec().shape.end());
+    }
+
+    // Elements first..first+count-1 (0-based) along the last dimension, as a new array
+    mx_array_t read(size_t first, size_t count) const {
+        const mmap_spec &s = spec();
+        scratch_vector<mwSize> dims(s.shape.begin(), s.shape.end());
+        if (dims.empty()) dims = {1, 1};
+        size_t last = dims.size() - 1;
+        if (first > dims[last] || count > dims[last] - first)
+            throw std::out_of_range(stringer("slice ", first, "+", count, " exceeds ", dims[last]));
+        size_t slab = s.numel() / std::max<size_t>(dims[last], 1) * mmap_class(s.classid).size;
+        dims[last] = count;
+        if (dims.size() == 1) dims.insert(dims.begin(), 1);
+        mxArray *res = mxCreateNumericArray(dims.size(), dims.data(), s.classid, mxREAL);
+        if (slab && count)
+            memcpy(mxGetData(res), static_cast<const char*>(file->data()) + first*slab, slab*count);
+        return res;
+    }
+
+    template<typename SaveLoader>
+    friend void save_load(SaveLoader &s, mmap_handle &h) {
+        mmap_spec spec = h.file ? h.file->spec : mmap_spec();
+        s & spec;
+        if (!h.file) h.file = std::make_shared<mapped_file>(spec);
+    }
+};
+
+// on_class<mmap_handle>("mmap_handle"), "_mmap_open"(path or spec) returning the handle,
+// "_mmap_read"(handle, first, count), "_mmap_size"(handle) and "_mmap_write"(path, array)
+inline void mmap_commands(MXCommands &m) {
+    m.on_class<mmap_handle>("mmap_handle");
+    m.on("_mmap_open", [](const mx_auto &spec) {
+        return new mmap_handle(mmap_spec_from_mx(spec, mxDOUBLE_CLASS));
+    });
+    m.on("_mmap_read", &mmap_handle::read);
+    m.on("_mmap_size", &mmap_handle::size);
+    m.on("_mmap_write", [](std::string path, const mx_auto &a) { mmap_write(path, a); });
+}
+} // namespace mexbind0x
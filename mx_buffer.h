@@ -0,0 +1,121 @@
+#pragma once
+#include "mex_cast.h"
+#include <algorithm>
+#include <cstring>
+#include <limits>
+#include <stdexcept>
+#include <vector>
+
+namespace mexbind0x {
+// Growable column of T in persistent mxMalloc memory, for handles created by
+// MXCommands::on_buffer. Capacity doubles, so appends are amortized O(1);
+// take() hands the storage to a new mxArray without copying.
+template<typename T>
+class mx_buffer {
+    static_assert(std::is_arithmetic<T>::value, "mx_buffer holds arithmetic elements");
+    T *data_ = nullptr;
+    size_t size_ = 0;
+    size_t capacity_ = 0;
+
+    void grow(size_t n) {
+        void *p = mxRealloc(data_, checked_extent_product(n, sizeof(T)));
+        if (!p) throw std::bad_alloc();
+        mexMakeMemoryPersistent(p);
+        data_ = static_cast<T*>(p);
+        capacity_ = n;
+    }
+public:
+    mx_buffer() = default;
+    explicit mx_buffer(size_t capacity) {
+        reserve(capacity);
+    }
+    mx_buffer(const mx_buffer&) = delete;
+    mx_buffer& operator=(const mx_buffer&) = delete;
+    mx_buffer(mx_buffer &&o) : data_(o.data_), size_(o.size_), capacity_(o.capacity_) {
+        o.data_ = nullptr;
+        o.size_ = o.capacity_ = 0;
+    }
+
+    ~mx_buffer() {
+        if (data_) mxFree(data_);
+    }
+
+    void reserve(size_t n) {
+        if (n > capacity_) grow(n);
+    }
+
+    size_t size() const {
+        return size_;
+    }
+
+    size_t capacity() const {
+        return capacity_;
+    }
+
+    const T *data() const {
+        return data_;
+    }
+
+    // Uninitialized room for n more elements
+    T *extend(size_t n) {
+        if (n > capacity_ - size_) {
+            const size_t max = std::numeric_limits<size_t>::max();
+            if (n > max - size_) throw std::length_error("mx_buffer too large");
+            grow(std::max(size_ + n, capacity_ > max / 2 ? max : 2*capacity_));
+        }
+        T *res = data_ + size_;
+        size_ += n;
+        return res;
+    }
+
+    void append(const T *src, size_t n) {
+        if (n) memcpy(extend(n), src, n * sizeof(T));
+    }
+
+    // Appends all elements of a real numeric or logical array, a plain memcpy if its class is T
+    void append(const mxArray *m) {
+        if (mxIsComplex(m) || mxIsSparse(m) || !(mxIsNumeric(m) || mxIsLogical(m) || mxIsChar(m)))
+            throw std::invalid_argument("can only append real full arrays");
+        size_t n = mxGetNumberOfElements(m);
+        if (mxGetClassID(m) == get_mex_classid<T>::value) {
+            append(static_cast<const T*>(mxGetData(m)), n);
+        } else if (n) {
+            auto conv = make_mx_converter<T>(m);
+            conv.gather(mxGetData(m), 0, 1, n, extend(n));
+        }
+    }
+
+    void clear() {
+        size_ = 0;
+    }
+
+    // Copy of the contents as a column vector
+    mxArray *view() const {
+        mxArray *res = mxCreateNumericMatrix(size_, 1, get_mex_classid<T>::value, mxREAL);
+        if (size_) memcpy(mxGetData(res), data_, size_ * sizeof(T));
+        return res;
+    }
+
+    // Moves the contents into a column vector, leaving the buffer empty
+    mxArray *take() {
+        if (!size_) return view();
+        if (size_ < capacity_) grow(size_);
+        mxArray *res = mxCreateNumericMatrix(0, 0, get_mex_classid<T>::value, mxREAL);
+        mxSetData(res, data_);
+        mxSetM(res, size_);
+        mxSetN(res, 1);
+        data_ = nullptr;
+        size_ = capacity_ = 0;
+        return res;
+    }
+
+    template<typename SaveLoader>
+    friend void save_load(SaveLoader &s, mx_buffer &b) {
+        std::vector<T> v(b.data_, b.data_ + b.size_);
+        s & v;
+        b.clear();
+        T *dst = b.extend(v.size());
+        for (size_t i=0; i<v.size(); i++) dst[i] = v[i];
+    }
+};
+} // namespace mexbind0x
@@ -0,0 +1,168 @@
+#pragma once
+#include "mex_cast.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <vector>
+
+namespace mexbind0x {
+// Single-producer single-consumer ring of frames of `channels` values of T, for
+// handles created by MXCommands::on_ring. One producer thread pushes without locks
+// or MEX calls; the MATLAB thread drains all available frames into a new array with
+// at most two memcpys. Frames that do not fit are dropped and counted as overruns.
+// Producers must be stopped before the handle is freed.
+template<typename T>
+class mx_ring {
+    static_assert(std::is_arithmetic<T>::value, "mx_ring holds arithmetic elements");
+    std::unique_ptr<T[]> data_;
+    size_t capacity_ = 0; // frames, a power of two
+    size_t channels_ = 1;
+
+    // Monotonic frame counters: head_ written by the producer, tail_ by the consumer,
+    // kept a cache line apart (padding rather than alignas, which C++14 new ignores)
+    std::atomic<size_t> head_{0};
+    char pad_head_[64];
+    std::atomic<size_t> tail_{0};
+    char pad_tail_[64];
+    std::atomic<size_t> overruns_{0}; // pushes that did not fit entirely
+    std::atomic<size_t> dropped_{0};  // frames lost by them
+
+    // Producers notify only while the consumer waits in wait_for
+    std::atomic<bool> waiting_{false};
+    std::mutex mutex_;
+    std::condition_variable cv_;
+
+    void allocate(size_t capacity, size_t channels) {
+        if (!channels) throw std::invalid_argument("mx_ring needs at least one channel");
+        if (capacity > (std::numeric_limits<size_t>::max() >> 1) + 1)
+            throw std::length_error("mx_ring capacity too large");
+        size_t n = 1;
+        while (n < capacity) n *= 2;
+        data_.reset(new T[checked_extent_product(n, channels)]);
+        capacity_ = n;
+        channels_ = channels;
+        head_ = tail_ = overruns_ = dropped_ = 0;
+    }
+
+    void notify() {
+        if (waiting_.load()) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            cv_.notify_one();
+        }
+    }
+
+    // Copies `frames` frames out of the ring starting at frame `from`, in at most two pieces
+    void copy_out(size_t from, size_t frames, T *dst) const {
+        size_t start = from & (capacity_ - 1);
+        size_t first = std::min(frames, capacity_ - start);
+        memcpy(dst, data_.get() + start * channels_, first * channels_ * sizeof(T));
+        if (frames > first)
+            memcpy(dst + first * channels_, data_.get(), (frames - first) * channels_ * sizeof(T));
+    }
+public:
+    mx_ring() : mx_ring(0) {}
+    explicit mx_ring(size_t capacity, size_t channels = 1) {
+        allocate(capacity, channels);
+    }
+    mx_ring(const mx_ring&) = delete;
+    mx_ring& operator=(const mx_ring&) = delete;
+    // Only while no producer is running
+    mx_ring(mx_ring &&o) : data_(std::move(o.data_)), capacity_(o.capacity_), channels_(o.channels_),
+                           head_(o.head_.load()), tail_(o.tail_.load()),
+                           overruns_(o.overruns_.load()), dropped_(o.dropped_.load()) {
+        o.allocate(0, 1);
+    }
+
+    size_t capacity() const { return capacity_; }
+    size_t channels() const { return channels_; }
+    size_t overruns() const { return overruns_.load(std::memory_order_relaxed); }
+    size_t dropped() const { return dropped_.load(std::memory_order_relaxed); }
+    size_t pushed() const { return head_.load(std::memory_order_relaxed); }
+    size_t drained() const { return tail_.load(std::memory_order_relaxed); }
+
+    // Frames available to the consumer
+    size_t size() const {
+        return head_.load(std::memory_order_acquire) - tail_.load(std::memory_order_relaxed);
+    }
+
+    // Producer: appends up to `frames` frames of channels() values each, returns how many fit
+    size_t push(const T *src, size_t frames) {
+        size_t head = head_.load(std::memory_order_relaxed);
+        size_t free = capacity_ - (head - tail_.load(std::memory_order_acquire));
+        size_t n = std::min(frames, free);
+        if (n < frames) {
+            overruns_.fetch_add(1, std::memory_order_relaxed);
+            dropped_.fetch_add(frames - n, std::memory_order_relaxed);
+        }
+        if (!n) return 0;
+        size_t start = head & (capacity_ - 1);
+        size_t first = std::min(n, capacity_ - start);
+        memcpy(data_.get() + start * channels_, src, first * channels_ * sizeof(T));
+        if (n > first)
+            memcpy(data_.get(), src + first * channels_, (n - first) * channels_ * sizeof(T));
+        head_.store(head + n, std::memory_order_seq_cst);
+        notify();
+        return n;
+    }
+
+    bool push(const T &value) {
+        if (channels_ != 1) throw std::logic_error("mx_ring::push(value) needs a single channel ring");
+        return push(&value, 1) == 1;
+    }
+
+    // Consumer: waits until at least `frames` frames are available or `timeout` passes
+    bool wait_for(size_t frames, std::chrono::duration<double> timeout) {
+        frames = std::min(frames, capacity_);
+        if (size() >= frames) return true;
+        std::unique_lock<std::mutex> lock(mutex_);
+        waiting_.store(true, std::memory_order_seq_cst);
+        bool ok = cv_.wait_for(lock, timeout, [&] {
+            return head_.load(std::memory_order_seq_cst) - tail_.load(std::memory_order_relaxed) >= frames;
+        });
+        waiting_.store(false);
+        return ok;
+    }
+
+    // Consumer: moves up to `max_frames` frames into a channels x n array (n x 1 for one channel)
+    mxArray *drain(size_t max_frames = static_cast<size_t>(-1)) {
+        size_t tail = tail_.load(std::memory_order_relaxed);
+        size_t n = std::min(max_frames, head_.load(std::memory_order_acquire) - tail);
+        mxArray *res = channels_ == 1 ? mxCreateNumericMatrix(n, 1, get_mex_classid<T>::value, mxREAL)
+                                      : mxCreateNumericMatrix(channels_, n, get_mex_classid<T>::value, mxREAL);
+        if (n) copy_out(tail, n, static_cast<T*>(mxGetData(res)));
+        tail_.store(tail + n, std::memory_order_release);
+        return res;
+    }
+
+    // Struct of capacity, channels, size, pushed, drained, overruns and dropped
+    mxArray *stats() const {
+        const char *fields[] = {"capacity", "channels", "size", "pushed", "drained", "overruns", "dropped"};
+        double values[] = {double(capacity_), double(channels_), double(size()), double(pushed()),
+                           double(drained()), double(overruns()), double(dropped())};
+        mxArray *res = mxCreateStructMatrix(1, 1, 7, fields);
+        for (int i=0; i<7; i++)
+            mxSetFieldByNumber(res, 0, i, mxCreateDoubleScalar(values[i]));
+        return res;
+    }
+
+    // Saves the capacity, channels and the frames not drained yet
+    template<typename SaveLoader>
+    friend void save_load(SaveLoader &s, mx_ring &r) {
+        size_t capacity = r.capacity_, channels = r.channels_, frames = r.size();
+        std::vector<T> v(frames * channels);
+        if (frames) r.copy_out(r.tail_.load(), frames, v.data());
+        s & capacity & channels & v;
+        // Unchanged when saving; when loading, rebuild the ring from what was read
+        if (capacity != r.capacity_ || channels != r.channels_ || v.size() != frames * r.channels_) {
+            r.allocate(capacity, channels);
+            r.push(v.data(), v.size() / channels);
+        }
+    }
+};
+} // namespace mexbind0x
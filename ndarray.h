@@ -6,6 +6,7 @@
 #include <cstddef>
 #include <cassert>
 #include <cstring>
+#include <cstdint>
 #ifdef MATLAB_MEX_FILE
 #include <matrix.h>
 #endif
@@ -22,6 +23,13 @@ struct count_ints<T,Args...> {
     static constexpr int value = (int)std::is_integral<typename std::remove_reference<T>::type>::value + count_ints<Args...>::value;
 };
 
+// Product of array extents, throws instead of wrapping around
+inline size_t checked_extent_product(size_t a, size_t b) {
+    if (b != 0 && a > SIZE_MAX / b)
+        throw std::overflow_error("array size overflows size_t");
+    return a * b;
+}
+
 struct NDArrayViewDimension {
     size_t strife;
     size_t maxIdx;
@@ -180,12 +188,12 @@ struct NDArrayView {
     }
 
     typename std::conditional<N==1,T&,NDArrayView<T,N-1>>::type
-    operator[](int i) const {
+    operator[](size_t i) const {
         return ndarray_curry_fast(*this,i);
     }
 
     typename std::conditional<N==1,T&,NDArrayView<T,N-1>>::type
-    at(int i) const {
+    at(size_t i) const {
         return ndarray_curry(*this,i);
     }
 
@@ -207,11 +215,11 @@ struct NDArrayView {
             if (mxGetNumberOfDimensions(a) != N)
                 throw std::invalid_argument("bad number of dimensions");
             const mwSize* dim = mxGetDimensions(a);
-            int mult = 1;
+            size_t mult = 1;
             for (int i=0; i<N; i++) {
                 dimensions[i].maxIdx = dim[i];
                 dimensions[i].strife = mult;
-                mult *= dim[i];
+                mult = checked_extent_product(mult, dim[i]);
             }
         }
     }
@@ -269,20 +277,20 @@ NDArrayView<T,sizeof...(Args)> makeNDArrayViewFromCArray(T* array, Args&& ... ar
     NDArrayView<T, sizeof...(Args)> result;
     size_t maxIdx[sizeof...(Args)] = {static_cast<size_t>(args)...};
     result.m_data = array;
-    int mult = 1;
+    size_t mult = 1;
     for (int i=sizeof...(Args)-1; i>=0; i--) {
         result.dimensions[i].maxIdx = maxIdx[i];
         result.dimensions[i].strife = mult;
-        mult *= maxIdx[i];
+        mult = checked_extent_product(mult, maxIdx[i]);
     }
     return result;
 }
 
 template<typename T, int N>
 typename std::enable_if<(N>1), NDArrayView<T,N-1> >::type
-ndarray_curry(const NDArrayView<T,N> &a, int fix)
+ndarray_curry(const NDArrayView<T,N> &a, size_t fix)
 {
-    if (fix< 0 || (size_t)fix >= a.dimensions[0].maxIdx)
+    if (fix >= a.dimensions[0].maxIdx)
         throw std::out_of_range("NDArrayView::limit index out of range");
     NDArrayView<T, N-1> result;
     result.m_data = a.m_data + a.dimensions[0].strife * fix;
@@ -292,7 +300,7 @@ ndarray_curry(const NDArrayView<T,N> &a, int fix)
 }
 
 template<typename T>
-T& ndarray_curry(const NDArrayView<T,1> &a, int fix)
+T& ndarray_curry(const NDArrayView<T,1> &a, size_t fix)
 {
     return a(fix);
 }
@@ -300,7 +308,7 @@ T& ndarray_curry(const NDArrayView<T,1> &a, int fix)
 
 template<typename T, int N>
 constexpr typename std::enable_if<(N>1), NDArrayView<T,N-1> >::type
-ndarray_curry_fast(const NDArrayView<T,N> &a, int fix) noexcept
+ndarray_curry_fast(const NDArrayView<T,N> &a, size_t fix) noexcept
 {
     return NDArrayView<T, N-1>(
         a.m_data + a.dimensions[0].strife * fix,
@@ -308,7 +316,7 @@ ndarray_curry_fast(const NDArrayView<T,N> &a, int fix) noexcept
 }
 
 template<typename T>
-constexpr T& ndarray_curry_fast(const NDArrayView<T,1> &a, int fix) noexcept
+constexpr T& ndarray_curry_fast(const NDArrayView<T,1> &a, size_t fix) noexcept
 {
     return a(fix);
 }
@@ -0,0 +1,306 @@
+#pragma once
+// Lazy elementwise expressions over NDArrayView.
+// Arithmetic, comparison and logical operators on views (and scalars) build an
+// expression tree; nd_assign(out, expr) evaluates it in a single pass over out.
+// Rows along the dimension of out with the smallest stride are evaluated with a
+// plain indexed loop when every operand is contiguous there, so the compiler can
+// vectorise it; other rows use the strides. out may appear in the expression
+// (in place), but must not partially overlap an operand.
+#include "ndarray.h"
+#include <algorithm>
+#include <functional>
+#include <stdexcept>
+#include <type_traits>
+
+#if defined(__clang__)
+#define NDEXPR_VECTORIZE _Pragma("clang loop vectorize(assume_safety)")
+#elif defined(__GNUC__)
+#define NDEXPR_VECTORIZE _Pragma("GCC ivdep")
+#else
+#define NDEXPR_VECTORIZE
+#endif
+
+namespace ndexpr {
+template<typename E> struct expr {};
+
+template<typename T>
+struct is_expr : std::is_base_of<expr<T>, T> {};
+
+template<typename T>
+struct is_view : std::false_type {};
+template<typename T, int N>
+struct is_view<NDArrayView<T,N>> : std::true_type {};
+
+template<typename T>
+struct is_operand : std::integral_constant<bool, is_expr<T>::value || is_view<T>::value> {};
+
+// At least one side is a view or expression, the other may be a scalar
+template<typename A, typename B>
+struct is_operand_pair : std::integral_constant<bool,
+    (is_operand<A>::value || is_operand<B>::value)
+    && (is_operand<A>::value || std::is_arithmetic<A>::value)
+    && (is_operand<B>::value || std::is_arithmetic<B>::value)> {};
+
+template<typename T, int N>
+struct leaf : expr<leaf<T,N>> {
+    using value_type = std::remove_const_t<T>;
+    static constexpr int rank = N;
+    const value_type *data;
+    NDArrayViewDimension dims[N];
+    const value_type *row = nullptr;
+    size_t step = 1;
+
+    explicit leaf(const NDArrayView<T,N> &v) : data(v.m_data) {
+        memcpy(dims, v.dimensions, sizeof(dims));
+    }
+
+    void check_shape(const NDArrayViewDimension *out) const {
+        for (int i=0; i<N; i++)
+            if (dims[i].maxIdx != out[i].maxIdx)
+                throw std::invalid_argument("NDArrayView expression: shape mismatch");
+    }
+
+    void begin_row(const size_t *idx, int inner) {
+        size_t offset = 0;
+        for (int d=0; d<N; d++)
+            if (d != inner) offset += idx[d] * dims[d].strife;
+        row = data + offset;
+        step = dims[inner].strife;
+    }
+
+    bool unit() const { return step == 1; }
+    value_type get(size_t i) const { return row[i*step]; }
+    value_type get_unit(size_t i) const { return row[i]; }
+};
+
+template<typename T>
+struct scalar : expr<scalar<T>> {
+    using value_type = T;
+    static constexpr int rank = 0;
+    T value;
+
+    explicit scalar(T value) : value(value) {}
+    void check_shape(const NDArrayViewDimension *) const {}
+    void begin_row(const size_t *, int) {}
+    bool unit() const { return true; }
+    T get(size_t) const { return value; }
+    T get_unit(size_t) const { return value; }
+};
+
+template<int A, int B>
+struct common_rank : std::integral_constant<int, A == 0 ? B : A> {
+    static_assert(A == 0 || B == 0 || A == B, "NDArrayView expression: operands have different ranks");
+};
+
+template<typename F, typename A>
+struct unary : expr<unary<F,A>> {
+    using value_type = std::decay_t<decltype(std::declval<F>()(std::declval<typename A::value_type>()))>;
+    static constexpr int rank = A::rank;
+    F f;
+    A a;
+
+    unary(F f, A a) : f(f), a(a) {}
+    void check_shape(const NDArrayViewDimension *out) const { a.check_shape(out); }
+    void begin_row(const size_t *idx, int inner) { a.begin_row(idx, inner); }
+    bool unit() const { return a.unit(); }
+    value_type get(size_t i) const { return f(a.get(i)); }
+    value_type get_unit(size_t i) const { return f(a.get_unit(i)); }
+};
+
+template<typename F, typename A, typename B>
+struct binary : expr<binary<F,A,B>> {
+    using value_type = std::decay_t<decltype(std::declval<F>()(std::declval<typename A::value_type>(),
+                                                               std::declval<typename B::value_type>()))>;
+    static constexpr int rank = common_rank<A::rank, B::rank>::value;
+    F f;
+    A a;
+    B b;
+
+    binary(F f, A a, B b) : f(f), a(a), b(b) {}
+    void check_shape(const NDArrayViewDimension *out) const { a.check_shape(out); b.check_shape(out); }
+    void begin_row(const size_t *idx, int inner) { a.begin_row(idx, inner); b.begin_row(idx, inner); }
+    bool unit() const { return a.unit() && b.unit(); }
+    value_type get(size_t i) const { return f(a.get(i), b.get(i)); }
+    value_type get_unit(size_t i) const { return f(a.get_unit(i), b.get_unit(i)); }
+};
+
+// Both branches are evaluated, the condition selects the result
+template<typename C, typename A, typename B>
+struct select : expr<select<C,A,B>> {
+    using value_type = std::common_type_t<typename A::value_type, typename B::value_type>;
+    static constexpr int rank = common_rank<C::rank, common_rank<A::rank, B::rank>::value>::value;
+    C c;
+    A a;
+    B b;
+
+    select(C c, A a, B b) : c(c), a(a), b(b) {}
+    void check_shape(const NDArrayViewDimension *out) const {
+        c.check_shape(out); a.check_shape(out); b.check_shape(out);
+    }
+    void begin_row(const size_t *idx, int inner) {
+        c.begin_row(idx, inner); a.begin_row(idx, inner); b.begin_row(idx, inner);
+    }
+    bool unit() const { return c.unit() && a.unit() && b.unit(); }
+    value_type get(size_t i) const {
+        value_type x = a.get(i), y = b.get(i);
+        return c.get(i) ? x : y;
+    }
+    value_type get_unit(size_t i) const {
+        value_type x = a.get_unit(i), y = b.get_unit(i);
+        return c.get_unit(i) ? x : y;
+    }
+};
+
+template<typename E>
+E operand(const expr<E> &e) {
+    return static_cast<const E&>(e);
+}
+
+template<typename T, int N>
+leaf<T,N> operand(const NDArrayView<T,N> &v) {
+    return leaf<T,N>(v);
+}
+
+template<typename T, typename = std::enable_if_t<std::is_arithmetic<T>::value>>
+scalar<T> operand(T value) {
+    return scalar<T>(value);
+}
+
+template<typename T>
+using operand_t = decltype(operand(std::declval<const T&>()));
+
+template<typename F, typename A>
+unary<F, operand_t<A>> make_unary(F f, const A &a) {
+    return {f, operand(a)};
+}
+
+template<typename F, typename A, typename B>
+binary<F, operand_t<A>, operand_t<B>> make_binary(F f, const A &a, const B &b) {
+    return {f, operand(a), operand(b)};
+}
+
+template<typename U>
+struct cast_to {
+    template<typename T>
+    U operator()(T x) const { return static_cast<U>(x); }
+};
+
+struct min_of {
+    template<typename A, typename B>
+    std::common_type_t<A,B> operator()(A a, B b) const { return b < a ? b : a; }
+};
+
+struct max_of {
+    template<typename A, typename B>
+    std::common_type_t<A,B> operator()(A a, B b) const { return a < b ? b : a; }
+};
+} // namespace ndexpr
+
+#define NDEXPR_BINARY_OPERATOR(op, functor) \
+template<typename A, typename B, typename = std::enable_if_t<ndexpr::is_operand_pair<A,B>::value>> \
+auto operator op(const A &a, const B &b) { \
+    return ndexpr::make_binary(functor(), a, b); \
+}
+
+NDEXPR_BINARY_OPERATOR(+, std::plus<>)
+NDEXPR_BINARY_OPERATOR(-, std::minus<>)
+NDEXPR_BINARY_OPERATOR(*, std::multiplies<>)
+NDEXPR_BINARY_OPERATOR(/, std::divides<>)
+NDEXPR_BINARY_OPERATOR(<, std::less<>)
+NDEXPR_BINARY_OPERATOR(<=, std::less_equal<>)
+NDEXPR_BINARY_OPERATOR(>, std::greater<>)
+NDEXPR_BINARY_OPERATOR(>=, std::greater_equal<>)
+NDEXPR_BINARY_OPERATOR(==, std::equal_to<>)
+NDEXPR_BINARY_OPERATOR(!=, std::not_equal_to<>)
+NDEXPR_BINARY_OPERATOR(&&, std::logical_and<>)
+NDEXPR_BINARY_OPERATOR(||, std::logical_or<>)
+#undef NDEXPR_BINARY_OPERATOR
+
+template<typename A, typename = std::enable_if_t<ndexpr::is_operand<A>::value>>
+auto operator-(const A &a) {
+    return ndexpr::make_unary(std::negate<>(), a);
+}
+
+template<typename A, typename = std::enable_if_t<ndexpr::is_operand<A>::value>>
+auto operator!(const A &a) {
+    return ndexpr::make_unary(std::logical_not<>(), a);
+}
+
+// Elementwise f(a) for any callable f
+template<typename F, typename A, typename = std::enable_if_t<ndexpr::is_operand<A>::value>>
+auto nd_map(F f, const A &a) {
+    return ndexpr::make_unary(f, a);
+}
+
+// Elementwise f(a, b) for any callable f
+template<typename F, typename A, typename B, typename = std::enable_if_t<ndexpr::is_operand_pair<A,B>::value>>
+auto nd_map(F f, const A &a, const B &b) {
+    return ndexpr::make_binary(f, a, b);
+}
+
+template<typename U, typename A, typename = std::enable_if_t<ndexpr::is_operand<A>::value>>
+auto nd_cast(const A &a) {
+    return ndexpr::make_unary(ndexpr::cast_to<U>(), a);
+}
+
+template<typename A, typename B>
+auto nd_min(const A &a, const B &b) {
+    return nd_map(ndexpr::min_of(), a, b);
+}
+
+template<typename A, typename B>
+auto nd_max(const A &a, const B &b) {
+    return nd_map(ndexpr::max_of(), a, b);
+}
+
+template<typename A, typename L, typename H>
+auto nd_clamp(const A &a, const L &lo, const H &hi) {
+    return nd_min(nd_max(a, lo), hi);
+}
+
+// c ? a : b elementwise, any of the three may be a scalar
+template<typename C, typename A, typename B>
+ndexpr::select<ndexpr::operand_t<C>, ndexpr::operand_t<A>, ndexpr::operand_t<B>>
+nd_where(const C &c, const A &a, const B &b) {
+    return {ndexpr::operand(c), ndexpr::operand(a), ndexpr::operand(b)};
+}
+
+// Evaluates e (an expression, a view or a scalar) into out in one pass.
+// Throws std::invalid_argument if the shapes of the operands differ from out.
+template<typename T, int N, typename E>
+void nd_assign(const NDArrayView<T,N> &out, const E &e_) {
+    auto e = ndexpr::operand(e_);
+    static_assert(decltype(e)::rank == 0 || decltype(e)::rank == N,
+                  "NDArrayView expression: rank differs from the output");
+    e.check_shape(out.dimensions);
+    int inner = 0;
+    for (int d=0; d<N; d++) {
+        if (out.dimensions[d].maxIdx == 0) return;
+        if (out.dimensions[d].maxIdx > 1 && (out.dimensions[inner].maxIdx <= 1
+                    || out.dimensions[d].strife < out.dimensions[inner].strife))
+            inner = d;
+    }
+    const size_t n = out.dimensions[inner].maxIdx, step = out.dimensions[inner].strife;
+    size_t idx[N] = {};
+    for (;;) {
+        T *row = out.m_data;
+        for (int d=0; d<N; d++)
+            if (d != inner) row += idx[d] * out.dimensions[d].strife;
+        e.begin_row(idx, inner);
+        if (step == 1 && e.unit()) {
+            NDEXPR_VECTORIZE
+            for (size_t i=0; i<n; i++)
+                row[i] = static_cast<T>(e.get_unit(i));
+        } else {
+            for (size_t i=0; i<n; i++)
+                row[i*step] = static_cast<T>(e.get(i));
+        }
+        int d = 0;
+        for (; d<N; d++) {
+            if (d == inner) continue;
+            if (++idx[d] < out.dimensions[d].maxIdx) break;
+            idx[d] = 0;
+        }
+        if (d == N) break;
+    }
+}
@@ -0,0 +1,250 @@
+#pragma once
+// Parallel algorithms over NDArrayView on a thread_pool.
+// Elements are visited in order of increasing stride, so each task's inner loop
+// runs along the contiguous dimension (the first one for MATLAB arrays, the last
+// one for makeNDArrayViewFromCArray) and limit() slices keep their strides.
+// Work is split into chunks of the visiting order: whole rows when there are
+// many, parts of a row when there are few.
+#include "ndarray.h"
+#include "thread_pool.h"
+#include <algorithm>
+#include <array>
+#include <limits>
+#include <stdexcept>
+#include <vector>
+#ifdef MATLAB_MEX_FILE
+#include "mex_lifecycle.h"
+#endif
+
+struct nd_parallel_options {
+    mexbind0x::thread_pool *pool = nullptr; // nd_default_pool() if null
+    size_t grain = 1 << 15;                 // elements per task at least
+    // Reductions combine chunks of a fixed size in a fixed order, so the result
+    // does not depend on the number of threads
+    bool deterministic = false;
+};
+
+// mex_pool() in MEX files, a process-wide pool otherwise
+inline mexbind0x::thread_pool& nd_default_pool() {
+#ifdef MATLAB_MEX_FILE
+    return mexbind0x::mex_pool();
+#else
+    static mexbind0x::thread_pool pool;
+    return pool;
+#endif
+}
+
+// Walks K views of the same shape in the stride order of view `lead`, one row segment at a time
+template<int N, size_t K>
+struct nd_walk {
+    int order[N];
+    size_t shape[N];
+    size_t strides[K][N];
+    size_t total = 1;
+
+    nd_walk(const size_t (&shape_)[N], const std::array<const NDArrayViewDimension*, K> &dims, size_t lead) {
+        for (int d=0; d<N; d++) {
+            shape[d] = shape_[d];
+            total *= shape[d];
+            order[d] = d;
+            for (size_t k=0; k<K; k++)
+                strides[k][d] = dims[k][d].strife;
+        }
+        // Extent 1 dimensions last, the others by increasing stride of the lead view
+        std::stable_sort(order, order + N, [&](int a, int b) {
+            if ((shape[a] > 1) != (shape[b] > 1)) return shape[a] > 1;
+            return strides[lead][a] < strides[lead][b];
+        });
+    }
+
+    // Number of the elements in a row, the unit of splitting
+    size_t row() const {
+        return shape[order[0]];
+    }
+
+    // Calls g(offsets, count, steps) for the row segments covering [begin, end) of the visiting order
+    template<typename G>
+    void run(size_t begin, size_t end, G &&g) const {
+        size_t idx[N];
+        size_t r = begin;
+        for (int j=0; j<N; j++) {
+            idx[order[j]] = r % shape[order[j]];
+            r /= shape[order[j]];
+        }
+        size_t steps[K];
+        for (size_t k=0; k<K; k++)
+            steps[k] = strides[k][order[0]];
+        for (size_t pos = begin; pos < end;) {
+            size_t count = std::min(shape[order[0]] - idx[order[0]], end - pos);
+            size_t offsets[K] = {};
+            for (size_t k=0; k<K; k++)
+                for (int d=0; d<N; d++)
+                    offsets[k] += idx[d] * strides[k][d];
+            g(offsets, count, steps);
+            pos += count;
+            idx[order[0]] += count;
+            for (int j=0; j<N-1 && idx[order[j]] == shape[order[j]]; j++) {
+                idx[order[j]] = 0;
+                idx[order[j+1]]++;
+            }
+        }
+    }
+};
+
+// Splits [0, total) into chunks of whole rows where possible and runs f(begin, end) for each
+template<typename F>
+void nd_parallel_chunks(size_t total, size_t row, size_t chunk, const nd_parallel_options &opt, F &&f) {
+    if (total == 0) return;
+    if (chunk >= row) chunk = (chunk / row) * row;
+    size_t n = (total + chunk - 1) / chunk;
+    if (n <= 1) {
+        f(size_t(0), total);
+        return;
+    }
+    mexbind0x::thread_pool &pool = opt.pool ? *opt.pool : nd_default_pool();
+    pool.parallel_for(n, [&](size_t i) {
+        f(i * chunk, std::min(total, (i + 1) * chunk));
+    });
+}
+
+// Elements per task: at least grain, at most four tasks per thread
+inline size_t nd_chunk_size(size_t total, const nd_parallel_options &opt) {
+    size_t threads = opt.pool ? opt.pool->size() : nd_default_pool().size();
+    size_t tasks = std::max<size_t>(1, 4 * threads);
+    return std::max<size_t>(std::max<size_t>(opt.grain, 1), (total + tasks - 1) / tasks);
+}
+
+template<typename T, int N>
+void nd_shape(const NDArrayView<T,N> &v, size_t (&shape)[N]) {
+    for (int d=0; d<N; d++)
+        shape[d] = v.dimensions[d].maxIdx;
+}
+
+// Calls f(x) for every element x (a T&) of v
+template<typename T, int N, typename F>
+void nd_parallel_for_each(const NDArrayView<T,N> &v, F f, const nd_parallel_options &opt = {}) {
+    size_t shape[N];
+    nd_shape(v, shape);
+    nd_walk<N,1> walk(shape, {{v.dimensions}}, 0);
+    nd_parallel_chunks(walk.total, walk.row(), nd_chunk_size(walk.total, opt), opt, [&](size_t begin, size_t end) {
+        walk.run(begin, end, [&](const size_t *off, size_t count, const size_t *step) {
+            T *p = v.m_data + off[0];
+            if (step[0] == 1)
+                for (size_t i=0; i<count; i++) f(p[i]);
+            else
+                for (size_t i=0; i<count; i++) f(p[i*step[0]]);
+        });
+    });
+}
+
+// out = f(in) elementwise, visiting in the stride order of in
+template<typename T, typename U, int N, typename F>
+void nd_parallel_transform(const NDArrayView<T,N> &in, const NDArrayView<U,N> &out, F f,
+                           const nd_parallel_options &opt = {}) {
+    size_t shape[N];
+    nd_shape(in, shape);
+    for (int d=0; d<N; d++)
+        if (out.dimensions[d].maxIdx != shape[d])
+            throw std::invalid_argument("nd_parallel_transform: shape mismatch");
+    nd_walk<N,2> walk(shape, {{in.dimensions, out.dimensions}}, 0);
+    nd_parallel_chunks(walk.total, walk.row(), nd_chunk_size(walk.total, opt), opt, [&](size_t begin, size_t end) {
+        walk.run(begin, end, [&](const size_t *off, size_t count, const size_t *step) {
+            T *src = in.m_data + off[0];
+            U *dst = out.m_data + off[1];
+            if (step[0] == 1 && step[1] == 1)
+                for (size_t i=0; i<count; i++) dst[i] = f(src[i]);
+            else
+                for (size_t i=0; i<count; i++) dst[i*step[1]] = f(src[i*step[0]]);
+        });
+    });
+}
+
+// op(... op(op(init, x0), x1) ...) over chunks, the partial results combined with op in chunk order.
+// op must be associative and init its identity.
+template<typename T, int N, typename R, typename Op>
+R nd_parallel_reduce(const NDArrayView<T,N> &v, R init, Op op, const nd_parallel_options &opt = {}) {
+    size_t shape[N];
+    nd_shape(v, shape);
+    nd_walk<N,1> walk(shape, {{v.dimensions}}, 0);
+    if (walk.total == 0) return init;
+    size_t chunk = opt.deterministic ? std::max<size_t>(opt.grain, 1) : nd_chunk_size(walk.total, opt);
+    if (chunk >= walk.row()) chunk = (chunk / walk.row()) * walk.row();
+    std::vector<R> partial((walk.total + chunk - 1) / chunk, init);
+    nd_parallel_chunks(walk.total, walk.row(), chunk, opt, [&](size_t begin, size_t end) {
+        R acc = init;
+        walk.run(begin, end, [&](const size_t *off, size_t count, const size_t *step) {
+            const T *p = v.m_data + off[0];
+            for (size_t i=0; i<count; i++) acc = op(acc, p[i*step[0]]);
+        });
+        partial[begin / chunk] = acc;
+    });
+    R res = init;
+    for (auto &p : partial) res = op(res, p);
+    return res;
+}
+
+// out = reduction of in along dimension k; out has the shape of in with extent 1 at k.
+// Each output element is computed by one task in index order, so the result is deterministic.
+template<typename T, typename R, int N, typename Op>
+void nd_parallel_reduce_axis(const NDArrayView<T,N> &in, int k, const NDArrayView<R,N> &out, R init, Op op,
+                             const nd_parallel_options &opt = {}) {
+    if (k < 0 || k >= N)
+        throw std::out_of_range("nd_parallel_reduce_axis: bad dimension");
+    size_t shape[N];
+    nd_shape(in, shape);
+    for (int d=0; d<N; d++)
+        if (out.dimensions[d].maxIdx != (d == k ? 1 : shape[d]))
+            throw std::invalid_argument("nd_parallel_reduce_axis: output shape should be the input's with 1 at the reduced dimension");
+    const size_t len = shape[k], stride = in.dimensions[k].strife;
+    shape[k] = 1;
+    nd_walk<N,2> walk(shape, {{in.dimensions, out.dimensions}}, 0);
+    // If the reduced dimension is the contiguous one, each output element is one pass along it.
+    // Otherwise rows of outputs are accumulated together, the inner loop running along the row.
+    bool along_row = walk.row() > 1 && in.dimensions[walk.order[0]].strife < stride;
+    size_t per_output = std::max<size_t>(len, 1);
+    size_t chunk = std::max<size_t>(nd_chunk_size(walk.total * per_output, opt) / per_output, 1);
+    nd_parallel_chunks(walk.total, walk.row(), chunk, opt, [&](size_t begin, size_t end) {
+        walk.run(begin, end, [&](const size_t *off, size_t count, const size_t *step) {
+            const T *src = in.m_data + off[0];
+            R *dst = out.m_data + off[1];
+            if (!along_row || len == 0) {
+                for (size_t i=0; i<count; i++) {
+                    R acc = init;
+                    const T *p = src + i*step[0];
+                    for (size_t j=0; j<len; j++) acc = op(acc, p[j*stride]);
+                    dst[i*step[1]] = acc;
+                }
+                return;
+            }
+            for (size_t i=0; i<count; i++) dst[i*step[1]] = init;
+            for (size_t j=0; j<len; j++) {
+                const T *p = src + j*stride;
+                for (size_t i=0; i<count; i++) dst[i*step[1]] = op(dst[i*step[1]], p[i*step[0]]);
+            }
+        });
+    });
+}
+
+template<typename T, typename R, int N>
+void nd_sum_axis(const NDArrayView<T,N> &in, int k, const NDArrayView<R,N> &out, const nd_parallel_options &opt = {}) {
+    nd_parallel_reduce_axis(in, k, out, R(0), [](R a, std::remove_const_t<T> b) { return a + b; }, opt);
+}
+
+template<typename T, typename R, int N>
+void nd_mean_axis(const NDArrayView<T,N> &in, int k, const NDArrayView<R,N> &out, const nd_parallel_options &opt = {}) {
+    nd_sum_axis(in, k, out, opt);
+    R n = static_cast<R>(in.dimensions[k].maxIdx);
+    nd_parallel_for_each(out, [n](R &x) { x /= n; }, opt);
+}
+
+template<typename T, typename R, int N>
+void nd_min_axis(const NDArrayView<T,N> &in, int k, const NDArrayView<R,N> &out, const nd_parallel_options &opt = {}) {
+    R init = std::numeric_limits<R>::has_infinity ? std::numeric_limits<R>::infinity() : std::numeric_limits<R>::max();
+    nd_parallel_reduce_axis(in, k, out, init, [](R a, std::remove_const_t<T> b) { return b < a ? R(b) : a; }, opt);
+}
+
+template<typename T, typename R, int N>
+void nd_max_axis(const NDArrayView<T,N> &in, int k, const NDArrayView<R,N> &out, const nd_parallel_options &opt = {}) {
+    R init = std::numeric_limits<R>::has_infinity ? -std::numeric_limits<R>::infinity() : std::numeric_limits<R>::lowest();
+    nd_parallel_reduce_axis(in, k, out, init, [](R a, std::remove_const_t<T> b) { return a < b ? R(b) : a; }, opt);
+}
@@ -0,0 +1,2 @@
+// The mexbind0x_runtime shared library, see runtime.h
+#include "runtime.h"
@@ -0,0 +1,150 @@
+#pragma once
+// Process-wide state: worker pool, cache budget and statistics.
+// By default every MEX file gets its own copy. Linking the mexbind0x_runtime shared
+// library (CMake option MEXBIND0X_SHARED_RUNTIME, which defines the macro of the same
+// name) makes all MEX files of a MATLAB session share one. The runtime is reference
+// counted: the pool is created on first use and joined when the last module releases it.
+// Does not use the MEX API, so the shared library builds without MATLAB.
+#include "thread_pool.h"
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+#ifdef MEXBIND0X_SHARED_RUNTIME
+#  if defined(_WIN32) && defined(MEXBIND0X_RUNTIME_BUILD)
+#    define MEXBIND0X_RUNTIME_API __declspec(dllexport)
+#  elif defined(_WIN32)
+#    define MEXBIND0X_RUNTIME_API __declspec(dllimport)
+#  else
+#    define MEXBIND0X_RUNTIME_API __attribute__((visibility("default")))
+#  endif
+#else
+#  define MEXBIND0X_RUNTIME_API inline
+#endif
+
+namespace mexbind0x {
+// Byte budget shared by several caches, each evicts its own entries while the total is over
+struct cache_budget {
+    std::atomic<size_t> used{0};
+    std::atomic<size_t> limit{SIZE_MAX};
+
+    void charge(size_t bytes) { used += bytes; }
+    void discharge(size_t bytes) { used -= bytes; }
+    bool over() const { return used.load() > limit.load(); }
+};
+
+class stats_registry {
+    std::mutex mutex;
+    std::map<std::string, double> values;
+public:
+    void add(const std::string &name, double delta) {
+        std::lock_guard<std::mutex> lock(mutex);
+        values[name] += delta;
+    }
+
+    void set(const std::string &name, double value) {
+        std::lock_guard<std::mutex> lock(mutex);
+        values[name] = value;
+    }
+
+    std::vector<std::pair<std::string, double>> snapshot() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return {values.begin(), values.end()};
+    }
+
+    void clear() {
+        std::lock_guard<std::mutex> lock(mutex);
+        values.clear();
+    }
+};
+
+// Returns the number of holders after the call
+MEXBIND0X_RUNTIME_API size_t runtime_acquire();
+MEXBIND0X_RUNTIME_API size_t runtime_release();
+MEXBIND0X_RUNTIME_API size_t runtime_holders();
+MEXBIND0X_RUNTIME_API thread_pool& runtime_pool();
+MEXBIND0X_RUNTIME_API cache_budget& runtime_cache_budget();
+MEXBIND0X_RUNTIME_API stats_registry& runtime_stats();
+// Sets pool_threads, pool_tasks and pool_pending in runtime_stats(), all 0 while the
+// pool is not started; does not start it
+MEXBIND0X_RUNTIME_API void runtime_record_pool_stats();
+
+#if !defined(MEXBIND0X_SHARED_RUNTIME) || defined(MEXBIND0X_RUNTIME_BUILD)
+namespace runtime_detail {
+struct state {
+    std::mutex mutex;
+    size_t holders = 0;
+    std::unique_ptr<thread_pool> pool;
+    cache_budget budget;
+    stats_registry stats;
+};
+
+// Never destroyed: modules may release it during process exit
+inline state& get() {
+    static state *s = new state();
+    return *s;
+}
+} // namespace runtime_detail
+
+MEXBIND0X_RUNTIME_API size_t runtime_acquire() {
+    auto &s = runtime_detail::get();
+    std::lock_guard<std::mutex> lock(s.mutex);
+    return ++s.holders;
+}
+
+MEXBIND0X_RUNTIME_API size_t runtime_release() {
+    auto &s = runtime_detail::get();
+    std::unique_ptr<thread_pool> pool;
+    size_t holders;
+    {
+        std::lock_guard<std::mutex> lock(s.mutex);
+        if (s.holders == 0)
+            throw std::logic_error("runtime_release without runtime_acquire");
+        holders = --s.holders;
+        if (holders == 0) {
+            pool = std::move(s.pool);
+            s.stats.clear();
+        }
+    }
+    return holders; // pool joined here, outside of the lock
+}
+
+MEXBIND0X_RUNTIME_API size_t runtime_holders() {
+    auto &s = runtime_detail::get();
+    std::lock_guard<std::mutex> lock(s.mutex);
+    return s.holders;
+}
+
+MEXBIND0X_RUNTIME_API thread_pool& runtime_pool() {
+    auto &s = runtime_detail::get();
+    std::lock_guard<std::mutex> lock(s.mutex);
+    if (s.holders == 0)
+        throw std::logic_error("runtime_pool used without runtime_acquire");
+    if (!s.pool)
+        s.pool.reset(new thread_pool());
+    return *s.pool;
+}
+
+MEXBIND0X_RUNTIME_API cache_budget& runtime_cache_budget() {
+    return runtime_detail::get().budget;
+}
+
+MEXBIND0X_RUNTIME_API stats_registry& runtime_stats() {
+    return runtime_detail::get().stats;
+}
+
+MEXBIND0X_RUNTIME_API void runtime_record_pool_stats() {
+    auto &s = runtime_detail::get();
+    std::lock_guard<std::mutex> lock(s.mutex);
+    s.stats.set("pool_threads", s.pool ? static_cast<double>(s.pool->size()) : 0);
+    s.stats.set("pool_tasks", s.pool ? static_cast<double>(s.pool->tasks_completed()) : 0);
+    s.stats.set("pool_pending", s.pool ? static_cast<double>(s.pool->tasks_pending()) : 0);
+}
+#endif
+} // namespace mexbind0x
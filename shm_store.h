@@ -0,0 +1,302 @@
+#pragma once
+#ifdef _WIN32
+#error "shm_store.h requires POSIX shared memory"
+#endif
+#include "mex_commands.h"
+#include "mex_lifecycle.h"
+#include "byte_archive.h"
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <string>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace mexbind0x {
+static_assert(ATOMIC_LLONG_LOCK_FREE == 2, "shared reference counts need lock-free atomics");
+
+constexpr uint64_t shm_magic = 0x3078304D42584D2FULL;
+constexpr size_t shm_max_dims = 16;
+
+enum class shm_kind : uint32_t { array = 1, object = 2 };
+
+struct shm_header {
+    std::atomic<uint64_t> magic;        // set once the payload is complete
+    std::atomic<long long> refs;        // processes attached
+    shm_kind kind;
+    uint32_t classid;
+    uint32_t complex;
+    uint32_t ndims;
+    uint64_t dims[shm_max_dims];
+    uint64_t payload_offset;
+    uint64_t bytes;                     // payload size, per real and imaginary part
+};
+
+// Named, reference-counted POSIX shared memory segment.
+// The header is writable, the payload is mapped read-only once filled.
+// The last process to detach unlinks the segment, unless the name was
+// unlinked and reused in the meantime.
+class shm_segment {
+    std::string name;
+    char *base = nullptr;
+    size_t length = 0;
+    dev_t device = 0;
+    ino_t inode = 0;
+
+    shm_segment(std::string name) : name(std::move(name)) {}
+
+    static std::string posix_name(const std::string &name) {
+        return "/mexbind0x." + name;
+    }
+
+    void map(int fd, size_t len) {
+        struct stat st;
+        if (fstat(fd, &st) == 0) {
+            device = st.st_dev;
+            inode = st.st_ino;
+        }
+        void *p = mmap(nullptr, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if (p == MAP_FAILED)
+            throw std::runtime_error(stringer("mmap of shared segment ", name, " failed: ", strerror(errno)));
+        base = static_cast<char*>(p);
+        length = len;
+    }
+
+    // Whether the name still refers to this segment
+    bool named() const {
+        int fd = shm_open(posix_name(name).c_str(), O_RDONLY, 0);
+        if (fd < 0) return false;
+        struct stat st;
+        bool res = fstat(fd, &st) == 0 && st.st_dev == device && st.st_ino == inode;
+        close(fd);
+        return res;
+    }
+public:
+    shm_segment(const shm_segment&) = delete;
+    shm_segment& operator=(const shm_segment&) = delete;
+
+    static std::shared_ptr<shm_segment> create(const std::string &name, size_t payload) {
+        std::shared_ptr<shm_segment> res(new shm_segment(name));
+        int fd = shm_open(posix_name(name).c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+        if (fd < 0 && errno == EEXIST)
+            throw std::runtime_error(stringer("shared segment ", name, " already exists; release it, or remove it "
+                                              "with shm_unlink_segment if its owner exited without releasing it"));
+        if (fd < 0)
+            throw std::runtime_error(stringer("cannot create shared segment ", name, ": ", strerror(errno)));
+        size_t offset = std::max<size_t>(sysconf(_SC_PAGESIZE), sizeof(shm_header));
+        if (ftruncate(fd, offset + payload) != 0) {
+            close(fd);
+            shm_unlink(posix_name(name).c_str());
+            throw std::runtime_error(stringer("cannot resize shared segment ", name, ": ", strerror(errno)));
+        }
+        res->map(fd, offset + payload);
+        shm_header *h = new (res->base) shm_header();
+        h->refs = 1;
+        h->payload_offset = offset;
+        return res;
+    }
+
+    static std::shared_ptr<shm_segment> attach(const std::string &name) {
+        std::shared_ptr<shm_segment> res(new shm_segment(name));
+        int fd = shm_open(posix_name(name).c_str(), O_RDWR, 0);
+        if (fd < 0)
+            throw std::runtime_error(stringer("cannot open shared segment ", name, ": ", strerror(errno)));
+        struct stat st;
+        if (fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < sizeof(shm_header)) {
+            close(fd);
+            throw std::runtime_error(stringer("shared segment ", name, " is not initialized"));
+        }
+        res->map(fd, st.st_size);
+        if (res->header().magic.load(std::memory_order_acquire) != shm_magic) {
+            munmap(res->base, res->length);
+            res->base = nullptr;
+            throw std::runtime_error(stringer("shared segment ", name, " is not ready"));
+        }
+        res->header().refs++;
+        res->protect();
+        return res;
+    }
+
+    ~shm_segment() {
+        if (!base) return;
+        if (--header().refs == 0 && named())
+            shm_unlink(posix_name(name).c_str());
+        munmap(base, length);
+    }
+
+    // Removes the name, e.g. of a segment left behind by a process that crashed.
+    // Processes attached to it keep their mapping. Returns false if there was none.
+    static bool unlink(const std::string &name) {
+        if (shm_unlink(posix_name(name).c_str()) == 0) return true;
+        if (errno == ENOENT) return false;
+        throw std::runtime_error(stringer("cannot remove shared segment ", name, ": ", strerror(errno)));
+    }
+
+    shm_header& header() const {
+        return *reinterpret_cast<shm_header*>(base);
+    }
+
+    char *payload() const {
+        return base + header().payload_offset;
+    }
+
+    // Publishes the filled payload to other processes
+    void seal() {
+        protect();
+        header().magic.store(shm_magic, std::memory_order_release);
+    }
+
+private:
+    void protect() {
+        size_t offset = header().payload_offset;
+        if (length > offset)
+            mprotect(base + offset, length - offset, PROT_READ);
+    }
+};
+
+// Segments this process holds a reference to, released when the MEX file is cleared
+inline std::map<std::string, std::shared_ptr<shm_segment>>& shm_registry() {
+    static std::map<std::string, std::shared_ptr<shm_segment>> *registry = nullptr;
+    if (!registry) {
+        registry = new std::map<std::string, std::shared_ptr<shm_segment>>();
+        at_mex_exit([] { delete registry; registry = nullptr; });
+    }
+    return *registry;
+}
+
+inline std::shared_ptr<shm_segment> shm_attach(const std::string &name) {
+    auto &registry = shm_registry();
+    auto it = registry.find(name);
+    if (it != registry.end()) return it->second;
+    auto seg = shm_segment::attach(name);
+    registry.emplace(name, seg);
+    return seg;
+}
+
+inline void shm_release(const std::string &name) {
+    shm_registry().erase(name);
+}
+
+// Releases the segment and removes its name even if other processes still hold it
+inline bool shm_unlink_segment(const std::string &name) {
+    shm_release(name);
+    return shm_segment::unlink(name);
+}
+
+// Copies a numeric array into a new segment
+inline void shm_put_array(const std::string &name, const mxArray *m) {
+    if (!(mxIsNumeric(m) || mxIsLogical(m) || mxIsChar(m)) || mxIsSparse(m))
+        throw std::invalid_argument("only full numeric, logical and char arrays can be shared");
+    size_t nd = mxGetNumberOfDimensions(m);
+    if (nd > shm_max_dims)
+        throw std::invalid_argument(stringer("at most ", shm_max_dims, " dimensions can be shared"));
+    size_t bytes = mxGetNumberOfElements(m) * mxGetElementSize(m);
+    bool complex = mxIsComplex(m);
+    auto seg = shm_segment::create(name, complex ? 2*bytes : bytes);
+    shm_header &h = seg->header();
+    h.kind = shm_kind::array;
+    h.classid = mxGetClassID(m);
+    h.complex = complex;
+    h.ndims = static_cast<uint32_t>(nd);
+    for (size_t i=0; i<nd; i++) h.dims[i] = mxGetDimensions(m)[i];
+    h.bytes = bytes;
+    if (bytes) memcpy(seg->payload(), mxGetData(m), bytes);
+    if (complex && bytes) memcpy(seg->payload() + bytes, mxGetImagData(m), bytes);
+    seg->seal();
+    shm_registry()[name] = seg;
+}
+
+// Serializes an object with save_load into a new segment
+template<typename T>
+void shm_put_object(const std::string &name, const T &t) {
+    ByteSaver s;
+    s << t;
+    auto seg = shm_segment::create(name, s.bytes().size());
+    shm_header &h = seg->header();
+    h.kind = shm_kind::object;
+    h.bytes = s.bytes().size();
+    memcpy(seg->payload(), s.bytes().data(), h.bytes);
+    seg->seal();
+    shm_registry()[name] = seg;
+}
+
+// Copy of a shared array as a new mxArray
+inline mxArray *shm_get_array(const std::string &name) {
+    auto seg = shm_attach(name);
+    const shm_header &h = seg->header();
+    if (h.kind != shm_kind::array)
+        throw std::invalid_argument(stringer("shared segment ", name, " does not hold an array"));
+    scratch_vector<mwSize> dims(h.dims, h.dims + h.ndims);
+    mxArray *res = mxCreateNumericArray(dims.size(), dims.data(), static_cast<mxClassID>(h.classid),
+                                        h.complex ? mxCOMPLEX : mxREAL);
+    if (h.bytes) memcpy(mxGetData(res), seg->payload(), h.bytes);
+    if (h.complex && h.bytes) memcpy(mxGetImagData(res), seg->payload() + h.bytes, h.bytes);
+    return res;
+}
+
+// Zero-copy argument: the segment name is passed from MATLAB,
+// the view points directly into the shared mapping.
+template<typename T, int N>
+struct shm_view : NDArrayView<const T, N> {
+    static constexpr bool can_mex_cast = true;
+    std::shared_ptr<shm_segment> segment;
+
+    shm_view(const std::string &name) : segment(shm_attach(name)) {
+        const shm_header &h = segment->header();
+        if (h.kind != shm_kind::array || h.classid != get_mex_classid<T>::value || h.complex)
+            throw std::invalid_argument(stringer("shared segment ", name, " does not hold a real ",
+                                                 get_type_name<T>(), " array"));
+        this->m_data = reinterpret_cast<const T*>(segment->payload());
+        size_t numel = 1;
+        for (size_t i=0; i<h.ndims; i++) numel = checked_extent_product(numel, h.dims[i]);
+        if (N == 1) {
+            this->dimensions[0] = {1, numel};
+            return;
+        }
+        size_t mult = 1;
+        for (size_t i=0; i<N; i++) {
+            size_t d = i < h.ndims ? h.dims[i] : 1;
+            this->dimensions[i] = {mult, d};
+            mult *= d;
+        }
+        if (mult != numel)
+            throw std::invalid_argument(stringer("shared segment ", name, " has more than ", N, " dimensions"));
+    }
+
+    shm_view(const mxArray *m) : shm_view(from_mx<std::string>(m)) {}
+};
+
+// Object deserialized from a segment created with shm_put_object
+template<typename T>
+struct shm_object {
+    static constexpr bool can_mex_cast = true;
+    T value;
+
+    shm_object(const std::string &name) {
+        auto seg = shm_attach(name);
+        const shm_header &h = seg->header();
+        if (h.kind != shm_kind::object)
+            throw std::invalid_argument(stringer("shared segment ", name, " does not hold an object"));
+        ByteLoader l(seg->payload(), h.bytes);
+        l >> value;
+    }
+
+    shm_object(const mxArray *m) : shm_object(from_mx<std::string>(m)) {}
+
+    const T& get() const { return value; }
+    operator const T&() const { return value; }
+};
+
+// "_shm_put"(name, array), "_shm_get"(name), "_shm_release"(name) and "_shm_unlink"(name)
+inline void shm_commands(MXCommands &m) {
+    m.on("_shm_put", [](std::string name, const mx_auto &a) { shm_put_array(name, a); });
+    m.on("_shm_get", [](std::string name) { return mx_array_t(shm_get_array(name)); });
+    m.on("_shm_release", [](std::string name) { shm_release(name); });
+    m.on("_shm_unlink", [](std::string name) { return shm_unlink_segment(name); });
+}
+} // namespace mexbind0x
@@ -0,0 +1,174 @@
+#pragma once
+#include "mex_cast.h"
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#if __cplusplus >= 201703L
+#include <string_view>
+#endif
+
+namespace mexbind0x {
+inline void append_utf8(std::vector<char> &out, const mxChar *s, size_t n) {
+    for (size_t i=0; i<n; i++) {
+        uint32_t c = s[i];
+        if (c >= 0xD800 && c < 0xDC00 && i+1 < n && s[i+1] >= 0xDC00 && s[i+1] < 0xE000)
+            c = 0x10000 + ((c - 0xD800) << 10) + (s[++i] - 0xDC00);
+        if (c < 0x80) {
+            out.push_back(static_cast<char>(c));
+        } else if (c < 0x800) {
+            out.push_back(static_cast<char>(0xC0 | (c >> 6)));
+            out.push_back(static_cast<char>(0x80 | (c & 0x3F)));
+        } else if (c < 0x10000) {
+            out.push_back(static_cast<char>(0xE0 | (c >> 12)));
+            out.push_back(static_cast<char>(0x80 | ((c >> 6) & 0x3F)));
+            out.push_back(static_cast<char>(0x80 | (c & 0x3F)));
+        } else {
+            out.push_back(static_cast<char>(0xF0 | (c >> 18)));
+            out.push_back(static_cast<char>(0x80 | ((c >> 12) & 0x3F)));
+            out.push_back(static_cast<char>(0x80 | ((c >> 6) & 0x3F)));
+            out.push_back(static_cast<char>(0x80 | (c & 0x3F)));
+        }
+    }
+}
+
+// Decodes UTF-8 into dst (if not null), returns the number of UTF-16 units
+inline size_t decode_utf8(const char *s, size_t n, mxChar *dst) {
+    size_t units = 0;
+    for (size_t i=0; i<n;) {
+        unsigned char b = static_cast<unsigned char>(s[i]);
+        uint32_t c;
+        size_t len = b < 0x80 ? 1 : b < 0xE0 ? 2 : b < 0xF0 ? 3 : 4;
+        if (i + len > n) len = 1;
+        c = len == 1 ? b : b & (0x7F >> len);
+        for (size_t k=1; k<len; k++)
+            c = (c << 6) | (static_cast<unsigned char>(s[i+k]) & 0x3F);
+        i += len;
+        if (c >= 0x10000) {
+            if (dst) {
+                dst[units] = static_cast<mxChar>(0xD800 + ((c - 0x10000) >> 10));
+                dst[units+1] = static_cast<mxChar>(0xDC00 + ((c - 0x10000) & 0x3FF));
+            }
+            units += 2;
+        } else {
+            if (dst) dst[units] = static_cast<mxChar>(c);
+            units++;
+        }
+    }
+    return units;
+}
+
+// Strings of a cellstr, string array or char matrix (one entry per row)
+// stored in a single UTF-8 arena with offsets.
+class string_table {
+    std::vector<char> chars;
+    std::vector<size_t> offsets{0};
+    std::vector<mwSize> shape;
+
+    void load_cell(const mxArray *m) {
+        size_t n = mxGetNumberOfElements(m);
+        size_t total = 0;
+        for (size_t i=0; i<n; i++) {
+            const mxArray *c = mxGetCell(m, i);
+            if (c && !mxIsChar(c))
+                throw std::invalid_argument(stringer("cell #", i, " is ", mxGetClassName(c), ", expected char"));
+            if (c) total += mxGetNumberOfElements(c);
+        }
+        chars.reserve(total);
+        offsets.reserve(n+1);
+        for (size_t i=0; i<n; i++) {
+            const mxArray *c = mxGetCell(m, i);
+            if (c) append_utf8(chars, static_cast<const mxChar*>(mxGetData(c)), mxGetNumberOfElements(c));
+            offsets.push_back(chars.size());
+        }
+    }
+
+    void load_char(const mxArray *m) {
+        size_t rows = mxGetM(m), cols = mxGetN(m);
+        const mxChar *data = static_cast<const mxChar*>(mxGetData(m));
+        std::vector<mxChar> row(cols);
+        for (size_t r=0; r<rows; r++) {
+            for (size_t c=0; c<cols; c++) row[c] = data[r + c*rows];
+            append_utf8(chars, row.data(), cols);
+            offsets.push_back(chars.size());
+        }
+        shape = {rows, 1};
+    }
+public:
+    static constexpr bool can_mex_cast = true;
+
+    string_table() = default;
+
+    string_table(const mxArray *m) {
+        if (mxIsCell(m)) {
+            shape.assign(mxGetDimensions(m), mxGetDimensions(m) + mxGetNumberOfDimensions(m));
+            load_cell(m);
+        } else if (mxIsChar(m)) {
+            load_char(m);
+        } else if (mxIsClass(m, "string")) {
+            mxArray *in = const_cast<mxArray*>(m), *cells = nullptr;
+            mexCallMATLAB(1, &cells, 1, &in, "cellstr");
+            shape.assign(mxGetDimensions(m), mxGetDimensions(m) + mxGetNumberOfDimensions(m));
+            load_cell(cells);
+            mxDestroyArray(cells);
+        } else
+            throw std::invalid_argument(stringer("expected cellstr or string array, got ", mxGetClassName(m)));
+    }
+
+    void push_back(const char *s, size_t n) {
+        chars.insert(chars.end(), s, s + n);
+        offsets.push_back(chars.size());
+        shape.clear();
+    }
+
+    void push_back(const std::string &s) {
+        push_back(s.data(), s.size());
+    }
+
+    void reserve(size_t strings, size_t total_chars) {
+        offsets.reserve(strings + 1);
+        chars.reserve(total_chars);
+    }
+
+    size_t size() const {
+        return offsets.size() - 1;
+    }
+
+    const char *data(size_t i) const {
+        return chars.data() + offsets[i];
+    }
+
+    size_t length(size_t i) const {
+        return offsets[i+1] - offsets[i];
+    }
+
+    std::string str(size_t i) const {
+        return std::string(data(i), length(i));
+    }
+
+#ifdef __cpp_lib_string_view
+    std::string_view operator[](size_t i) const {
+        return std::string_view(data(i), length(i));
+    }
+#endif
+
+    // Dimensions of the resulting cell array, a column unless loaded from MATLAB
+    std::vector<mwSize> dimensions() const {
+        if (shape.empty()) return {size(), 1};
+        return shape;
+    }
+};
+
+inline mxArray *to_mx(const string_table &t) {
+    auto dims = t.dimensions();
+    mxArray *res = mxCreateCellArray(dims.size(), dims.data());
+    for (size_t i=0; i<t.size(); i++) {
+        size_t units = decode_utf8(t.data(i), t.length(i), nullptr);
+        mwSize d[2] = {units ? 1u : 0u, units};
+        mxArray *s = mxCreateCharArray(2, d);
+        decode_utf8(t.data(i), t.length(i), static_cast<mxChar*>(mxGetData(s)));
+        mxSetCell(res, i, s);
+    }
+    return res;
+}
+} // namespace mexbind0x
@@ -0,0 +1,227 @@
+#pragma once
+#include "trace.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+namespace mexbind0x {
+// Worker threads with one task deque each. A worker runs its own tasks newest
+// first and steals the oldest tasks of the others when it runs out; tasks
+// submitted from outside the pool are spread over the deques.
+// Does not use the MEX API, tasks must not either.
+class thread_pool {
+    struct task_queue {
+        std::mutex mutex;
+        std::deque<std::function<void()>> tasks;
+    };
+
+    std::vector<std::unique_ptr<task_queue>> queues;
+    std::vector<std::thread> workers;
+    std::mutex mutex;                // only for workers going to sleep and waking them
+    std::condition_variable cv;
+    std::atomic<size_t> pending{0};  // tasks in the deques or being pushed
+    std::atomic<size_t> sleepers{0}; // workers waiting on cv
+    std::atomic<size_t> completed{0};
+    std::atomic<size_t> next_queue{0};
+    std::atomic<bool> stopping{false};
+
+    struct worker_id {
+        const thread_pool *pool;
+        size_t index;
+    };
+
+    static worker_id& current() {
+        thread_local worker_id id{nullptr, 0};
+        return id;
+    }
+
+    // The deque of the calling worker, or queues.size() for other threads
+    size_t own_queue() const {
+        const worker_id &id = current();
+        return id.pool == this ? id.index : queues.size();
+    }
+
+    // Takes only the deque lock. pending is raised before stopping is checked and
+    // sleepers read after it, so neither stop() nor a worker going to sleep misses the task.
+    void push(std::function<void()> task) {
+        size_t q = own_queue();
+        if (q == queues.size())
+            q = next_queue++ % queues.size();
+        pending++;
+        if (stopping.load()) {
+            pending--;
+            throw std::logic_error("thread_pool is stopped");
+        }
+        {
+            std::lock_guard<std::mutex> queue_lock(queues[q]->mutex);
+            queues[q]->tasks.push_back(std::move(task));
+        }
+        if (sleepers.load() > 0) {
+            std::lock_guard<std::mutex> lock(mutex);
+            cv.notify_one();
+        }
+    }
+
+    bool pop(size_t self, std::function<void()> &task) {
+        if (pending.load() == 0)
+            return false;
+        if (self < queues.size()) {
+            std::lock_guard<std::mutex> lock(queues[self]->mutex);
+            if (!queues[self]->tasks.empty()) {
+                task = std::move(queues[self]->tasks.back());
+                queues[self]->tasks.pop_back();
+                pending--;
+                return true;
+            }
+        }
+        for (size_t i=1; i<=queues.size(); i++) {
+            auto &q = *queues[(self + i) % queues.size()];
+            std::lock_guard<std::mutex> lock(q.mutex);
+            if (!q.tasks.empty()) {
+                task = std::move(q.tasks.front());
+                q.tasks.pop_front();
+                pending--;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void run(std::function<void()> &task) {
+        trace_span span("worker", "pool task");
+        task();
+        completed.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void work(size_t index) {
+        current() = {this, index};
+        for (;;) {
+            std::function<void()> task;
+            if (pop(index, task)) {
+                run(task);
+                continue;
+            }
+            std::unique_lock<std::mutex> lock(mutex);
+            sleepers++;
+            cv.wait(lock, [this] { return stopping.load() || pending.load() > 0; });
+            sleepers--;
+            if (stopping.load() && pending.load() == 0) return;
+        }
+    }
+public:
+    explicit thread_pool(size_t threads = std::thread::hardware_concurrency()) {
+        threads = std::max<size_t>(threads, 1);
+        for (size_t i=0; i<threads; i++)
+            queues.emplace_back(new task_queue());
+        for (size_t i=0; i<threads; i++)
+            workers.emplace_back([this, i] { work(i); });
+    }
+
+    thread_pool(const thread_pool&) = delete;
+    thread_pool& operator=(const thread_pool&) = delete;
+
+    ~thread_pool() {
+        stop();
+    }
+
+    size_t size() const {
+        return workers.size();
+    }
+
+    // Tasks queued and not yet started
+    size_t tasks_pending() const { return pending.load(std::memory_order_relaxed); }
+    size_t tasks_completed() const { return completed.load(std::memory_order_relaxed); }
+
+    template<typename F>
+    std::future<std::result_of_t<F()>> submit(F&& f) {
+        auto task = std::make_shared<std::packaged_task<std::result_of_t<F()>()>>(std::forward<F>(f));
+        auto res = task->get_future();
+        push([task] { (*task)(); });
+        return res;
+    }
+
+    // Calls f(i) for i in [0, n) on the workers and the calling thread, which runs
+    // queued tasks until all n are done, so nested calls from tasks do not deadlock.
+    // Rethrows the first exception thrown by f.
+    template<typename F>
+    void parallel_for(size_t n, F&& f) {
+        if (n == 0) return;
+        if (n == 1) {
+            trace_span span("worker", "parallel_for inline");
+            f(size_t(0));
+            return;
+        }
+        struct state {
+            std::atomic<size_t> left;
+            std::mutex mutex;
+            std::condition_variable done;
+            std::exception_ptr error;
+        };
+        auto st = std::make_shared<state>();
+        st->left = n;
+        auto run_one = [st, &f](size_t i) {
+            try {
+                f(i);
+            } catch (...) {
+                std::lock_guard<std::mutex> lock(st->mutex);
+                if (!st->error) st->error = std::current_exception();
+            }
+            if (--st->left == 0) {
+                std::lock_guard<std::mutex> lock(st->mutex);
+                st->done.notify_all();
+            }
+        };
+        // Tasks already queued reference f, so a failed push still waits for them
+        std::exception_ptr push_error;
+        size_t pushed = 1;
+        try {
+            for (; pushed<n; pushed++)
+                push([run_one, pushed] { run_one(pushed); });
+        } catch (...) {
+            push_error = std::current_exception();
+            st->left -= n - pushed + 1;
+        }
+        if (!push_error) {
+            trace_span span("worker", "parallel_for inline");
+            run_one(0);
+        }
+        size_t self = own_queue();
+        while (st->left.load() > 0) {
+            std::function<void()> task;
+            if (pop(self, task)) {
+                run(task);
+                continue;
+            }
+            std::unique_lock<std::mutex> lock(st->mutex);
+            st->done.wait_for(lock, std::chrono::milliseconds(1), [&] { return st->left.load() == 0; });
+        }
+        if (push_error)
+            std::rethrow_exception(push_error);
+        if (st->error)
+            std::rethrow_exception(st->error);
+    }
+
+    // Runs the queued tasks to completion and joins the workers
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        cv.notify_all();
+        for (auto &w : workers)
+            if (w.joinable()) w.join();
+    }
+};
+} // namespace mexbind0x
@@ -0,0 +1,176 @@
+#pragma once
+// Span tracing of commands, argument and output conversions and worker tasks.
+// Compiled in with -DMEXBIND0X_TRACE, otherwise trace_span does nothing.
+// "_trace_dump"(file) writes the recorded spans as Chrome trace JSON
+// (chrome://tracing, ui.perfetto.dev).
+// Does not depend on the MEX headers, so that thread_pool.h can record worker spans.
+#include <cstddef>
+#ifdef MEXBIND0X_TRACE
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <unistd.h>
+#endif
+
+namespace mexbind0x {
+#ifdef MEXBIND0X_TRACE
+struct trace_event {
+    const char *cat;
+    const char *name;
+    uint64_t begin;             // ns since trace_epoch()
+    uint64_t duration;
+    uint32_t tid;
+    char detail[48];
+};
+
+// Fixed-size ring buffer, the oldest spans are overwritten
+class trace_buffer {
+    std::mutex mutex;
+    std::vector<trace_event> events;
+    size_t next = 0;
+    size_t recorded = 0;
+public:
+    explicit trace_buffer(size_t capacity) : events(capacity) {}
+
+    void push(const trace_event &e) {
+        std::lock_guard<std::mutex> lock(mutex);
+        events[next] = e;
+        next = (next + 1) % events.size();
+        recorded++;
+    }
+
+    void clear() {
+        std::lock_guard<std::mutex> lock(mutex);
+        next = 0;
+        recorded = 0;
+    }
+
+    size_t size() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return std::min(recorded, events.size());
+    }
+
+    // Returns the number of spans written
+    size_t dump(const std::string &path) {
+        std::lock_guard<std::mutex> lock(mutex);
+        FILE *f = fopen(path.c_str(), "w");
+        if (!f)
+            throw std::runtime_error("cannot open " + path);
+        size_t n = std::min(recorded, events.size());
+        size_t first = recorded > events.size() ? next : 0;
+        fprintf(f, "{\"traceEvents\":[\n");
+        for (size_t i=0; i<n; i++) {
+            const trace_event &e = events[(first + i) % events.size()];
+            fprintf(f, "%s{\"name\":\"", i ? ",\n" : "");
+            write_escaped(f, e.name);
+            fprintf(f, "\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%u",
+                    e.cat, e.begin / 1e3, e.duration / 1e3, static_cast<int>(getpid()), e.tid);
+            if (e.detail[0]) {
+                fprintf(f, ",\"args\":{\"detail\":\"");
+                write_escaped(f, e.detail);
+                fprintf(f, "\"}");
+            }
+            fprintf(f, "}");
+        }
+        fprintf(f, "\n]}\n");
+        bool ok = !ferror(f);
+        fclose(f);
+        if (!ok)
+            throw std::runtime_error("cannot write " + path);
+        return n;
+    }
+
+private:
+    static void write_escaped(FILE *f, const char *s) {
+        for (; *s; s++) {
+            unsigned char c = *s;
+            if (c == '"' || c == '\\') fprintf(f, "\\%c", c);
+            else if (c < 0x20) fprintf(f, "\\u%04x", c);
+            else fputc(c, f);
+        }
+    }
+};
+
+// Freed when the MEX file is unloaded, after the workers were joined by mexAtExit
+inline trace_buffer& trace_events() {
+    static trace_buffer buffer(1 << 16);
+    return buffer;
+}
+
+inline std::chrono::steady_clock::time_point trace_epoch() {
+    static const auto epoch = std::chrono::steady_clock::now();
+    return epoch;
+}
+
+inline uint64_t trace_now() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - trace_epoch()).count();
+}
+
+inline uint32_t trace_thread_id() {
+    static std::atomic<uint32_t> count{0};
+    thread_local uint32_t id = count++;
+    return id;
+}
+
+// Records its lifetime as a complete ("X") event
+class trace_span {
+    trace_event e;
+public:
+    trace_span(const char *cat, const char *name) {
+        e.cat = cat;
+        e.name = name;
+        e.detail[0] = '\0';
+        e.tid = trace_thread_id();
+        e.begin = trace_now();
+    }
+
+    // Argument or output number index with its class and dimensions.
+    // Templates so that the MEX API is only needed where they are used.
+    template<typename Array>
+    trace_span(const char *cat, const char *name, int index, const Array *m)
+        : trace_span(cat, name) {
+        describe(index, m);
+    }
+
+    trace_span(const trace_span&) = delete;
+    trace_span& operator=(const trace_span&) = delete;
+
+    template<typename Array>
+    void describe(int index, const Array *m) {
+        if (!m) {
+            snprintf(e.detail, sizeof(e.detail), "#%d", index);
+            return;
+        }
+        int len = snprintf(e.detail, sizeof(e.detail), "#%d %s ", index, mxGetClassName(m));
+        size_t nd = mxGetNumberOfDimensions(m);
+        const auto *dims = mxGetDimensions(m);
+        for (size_t i=0; i<nd && len > 0 && static_cast<size_t>(len) < sizeof(e.detail); i++)
+            len += snprintf(e.detail + len, sizeof(e.detail) - len, i ? "x%zu" : "%zu",
+                            static_cast<size_t>(dims[i]));
+    }
+
+    ~trace_span() {
+        e.duration = trace_now() - e.begin;
+        trace_events().push(e);
+    }
+};
+#else
+class trace_span {
+public:
+    trace_span(const char *, const char *) {}
+    template<typename Array>
+    trace_span(const char *, const char *, int, const Array *) {}
+    trace_span(const trace_span&) = delete;
+    trace_span& operator=(const trace_span&) = delete;
+    template<typename Array>
+    void describe(int, const Array *) {}
+};
+#endif
+} // namespace mexbind0x